@@ -1,61 +1,236 @@
 #include "AcclerationStructures.h"
+#include "TaskPool.h"
 #include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <immintrin.h>
+#include <optional>
 
-bool MeshQuery::AccelerationStructure::intersect(const Ray & r, const AABB & aabb) const
+namespace
 {
-	float tMin = (aabb.min_.x - r.origin_.x) / r.direction_.x;
-	float tMax = (aabb.max_.x - r.origin_.x) / r.direction_.x;
-
-	if (tMin > tMax)
+	//Spreads the low 10 bits of x so there are two zero bits between each of them
+	inline uint64_t leftShift3(uint32_t x)
 	{
-		std::swap(tMin, tMax);
+		uint64_t v = x & 0x3ff;
+		v = (v | (v << 16)) & 0x30000ff;
+		v = (v | (v << 8)) & 0x300f00f;
+		v = (v | (v << 4)) & 0x30c30c3;
+		v = (v | (v << 2)) & 0x9249249;
+		return v;
 	}
 
-	float tyMin = (aabb.min_.y - r.origin_.y) / r.direction_.y;
-	float tyMax = (aabb.max_.y - r.origin_.y) / r.direction_.y;
+	//Same as leftShift3 for the low 21 bits of x
+	inline uint64_t leftShift3Wide(uint32_t x)
+	{
+		uint64_t v = x & 0x1fffff;
+		v = (v | (v << 32)) & 0x1f00000000ffffull;
+		v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+		v = (v | (v << 8)) & 0x100f00f00f00f00full;
+		v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+		v = (v | (v << 2)) & 0x1249249249249249ull;
+		return v;
+	}
 
-	if (tyMin > tyMax)
+	//Parallel LSD radix sort on the low nBits of the Morton codes, 8 bits per pass
+	void radixSort(std::vector<MeshQuery::MortonPrimitive>* v, int nBits)
 	{
-		std::swap(tyMin, tyMax);
+		const int bitsPerPass = 8;
+		const int nBuckets = 1 << bitsPerPass;
+		const int nPasses = (nBits + bitsPerPass - 1) / bitsPerPass;
+		const size_t n = v->size();
+		const size_t nChunks = std::max<size_t>(1, std::min<size_t>(MeshQuery::TaskPool::instance().threadCount(), n / 4096));
+		const size_t chunkSize = (n + nChunks - 1) / nChunks;
+
+		std::vector<MeshQuery::MortonPrimitive> tempVector(n);
+		std::vector<size_t> offsets(nChunks * nBuckets);
+
+		for (int pass = 0; pass < nPasses; pass++) {
+			const int lowBit = pass * bitsPerPass;
+			std::vector<MeshQuery::MortonPrimitive>& in = (pass & 1) ? tempVector : *v;
+			std::vector<MeshQuery::MortonPrimitive>& out = (pass & 1) ? *v : tempVector;
+
+			auto digitOf = [lowBit](const MeshQuery::MortonPrimitive& mp) {
+				return static_cast<size_t>((mp.mortonCode_ >> lowBit) & (nBuckets - 1));
+			};
+
+			std::fill(offsets.begin(), offsets.end(), 0);
+			MeshQuery::TaskPool::instance().parallelFor(nChunks, [&](size_t c) {
+				size_t* count = &offsets[c * nBuckets];
+				for (size_t i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); i++)
+					count[digitOf(in[i])]++;
+			});
+
+			//Bucket major prefix sum keeps the scatter stable across chunks
+			size_t running = 0;
+			for (int b = 0; b < nBuckets; b++) {
+				for (size_t c = 0; c < nChunks; c++) {
+					size_t count = offsets[c * nBuckets + b];
+					offsets[c * nBuckets + b] = running;
+					running += count;
+				}
+			}
+
+			MeshQuery::TaskPool::instance().parallelFor(nChunks, [&](size_t c) {
+				size_t* offset = &offsets[c * nBuckets];
+				for (size_t i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); i++)
+					out[offset[digitOf(in[i])]++] = in[i];
+			});
+		}
+
+		if (nPasses & 1)
+			std::swap(*v, tempVector);
 	}
 
-	if ((tMin > tyMax) || (tyMin > tMax))
-		return false;
+	//One chunk per worker, none smaller than 4096 primitives
+	inline size_t chunkCount(size_t n)
+	{
+		return std::max<size_t>(1, std::min<size_t>(MeshQuery::TaskPool::instance().threadCount(), n / 4096));
+	}
 
-	if (tyMin > tMin)
-		tMin = tyMin;
+	inline __m128 loadVec3(const glm::vec3& v)
+	{
+		return _mm_setr_ps(v.x, v.y, v.z, v.z);
+	}
 
-	if (tyMax < tMax)
-		tMax = tyMax;
+	inline glm::vec3 storeVec3(__m128 v)
+	{
+		alignas(16) float f[4];
+		_mm_store_ps(f, v);
+		return glm::vec3(f[0], f[1], f[2]);
+	}
 
-	float tzMin = (aabb.min_.z - r.origin_.z) / r.direction_.z;
-	float tzMax = (aabb.max_.z - r.origin_.z) / r.direction_.z;
+	//Upper bound on the parallel chunks of computeBounds, so their partial boxes fit in a fixed array
+	const size_t MAX_BOUNDS_CHUNKS = 64;
 
-	if (tzMin > tzMax)
+	//Boxes and centroids of n primitives in one SSE min/max pass, split into parallel chunks above cutoff
+	void computeBounds(const MeshQuery::PrimitiveInfo* prims, size_t n, size_t cutoff, MeshQuery::AABB* bounds, MeshQuery::AABB* centroidBounds)
 	{
-		std::swap(tzMin, tzMax);
+		auto reduce = [prims](size_t begin, size_t end, MeshQuery::AABB* b, MeshQuery::AABB* c) {
+			__m128 bMin = _mm_set1_ps(std::numeric_limits<float>::max()), cMin = bMin;
+			__m128 bMax = _mm_set1_ps(std::numeric_limits<float>::lowest()), cMax = bMax;
+			for (size_t i = begin; i < end; i++) {
+				bMin = _mm_min_ps(bMin, loadVec3(prims[i].aabb_.min_));
+				bMax = _mm_max_ps(bMax, loadVec3(prims[i].aabb_.max_));
+				const __m128 centroid = loadVec3(prims[i].centroid_);
+				cMin = _mm_min_ps(cMin, centroid);
+				cMax = _mm_max_ps(cMax, centroid);
+			}
+
+			*b = MeshQuery::AABB(storeVec3(bMin), storeVec3(bMax));
+			*c = MeshQuery::AABB(storeVec3(cMin), storeVec3(cMax));
+		};
+
+		const size_t nChunks = n > cutoff ? std::min(chunkCount(n), MAX_BOUNDS_CHUNKS) : 1;
+		if (nChunks == 1) {
+			reduce(0, n, bounds, centroidBounds);
+			return;
+		}
+
+		const size_t chunkSize = (n + nChunks - 1) / nChunks;
+		MeshQuery::AABB chunkBounds[MAX_BOUNDS_CHUNKS], chunkCentroidBounds[MAX_BOUNDS_CHUNKS];
+		MeshQuery::TaskPool::instance().parallelFor(nChunks, [&](size_t c) {
+			reduce(c * chunkSize, std::min(n, (c + 1) * chunkSize), &chunkBounds[c], &chunkCentroidBounds[c]);
+		});
+
+		*bounds = chunkBounds[0];
+		*centroidBounds = chunkCentroidBounds[0];
+		for (size_t c = 1; c < nChunks; c++) {
+			*bounds = Union(*bounds, chunkBounds[c]);
+			*centroidBounds = Union(*centroidBounds, chunkCentroidBounds[c]);
+		}
 	}
 
-	if ((tMin > tzMax) || (tzMin > tMax))
-		return false;
+	//Partitions n primitives by pred, returns the size of the true side. Above cutoff every chunk counts its
+	//true side, a prefix sum gives each chunk its output ranges, and the chunks scatter in parallel through a
+	//scratch buffer, which also keeps the order on both sides.
+	template <typename Predicate>
+	size_t partitionPrimitives(MeshQuery::PrimitiveInfo* prims, size_t n, size_t cutoff, Predicate pred)
+	{
+		if (n <= cutoff)
+			return std::partition(prims, prims + n, pred) - prims;
 
-	if (tzMin > tMin)
-		tMin = tzMin;
+		const size_t nChunks = chunkCount(n);
+		const size_t chunkSize = (n + nChunks - 1) / nChunks;
+		MeshQuery::TaskPool& pool = MeshQuery::TaskPool::instance();
 
-	if (tzMax < tMax)
-		tMax = tzMax;
+		std::vector<size_t> trueCount(nChunks);
+		pool.parallelFor(nChunks, [&](size_t c) {
+			size_t count = 0;
+			for (size_t i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); i++)
+				count += pred(prims[i]) ? 1 : 0;
+			trueCount[c] = count;
+		});
 
-	return true;
+		std::vector<size_t> trueOffset(nChunks), falseOffset(nChunks);
+		size_t nTrue = 0;
+		for (size_t c = 0; c < nChunks; c++) {
+			trueOffset[c] = nTrue;
+			nTrue += trueCount[c];
+		}
+		for (size_t c = 0; c < nChunks; c++) {
+			falseOffset[c] = nTrue + c * chunkSize - trueOffset[c];
+		}
+
+		std::vector<MeshQuery::PrimitiveInfo> scratch(n);
+		pool.parallelFor(nChunks, [&](size_t c) {
+			size_t t = trueOffset[c], f = falseOffset[c];
+			for (size_t i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); i++)
+				scratch[pred(prims[i]) ? t++ : f++] = prims[i];
+		});
+
+		pool.parallelFor(nChunks, [&](size_t c) {
+			const size_t begin = std::min(n, c * chunkSize), end = std::min(n, (c + 1) * chunkSize);
+			std::copy(scratch.begin() + begin, scratch.begin() + end, prims + begin);
+		});
+
+		return nTrue;
+	}
+
+	template <typename Pack>
+	void storeTriangle(Pack& pack, size_t lane, const MeshQuery::Triangle& triangle)
+	{
+		const glm::vec3& v0 = triangle.vertices_[0];
+		const glm::vec3 e1 = triangle.vertices_[1] - v0;
+		const glm::vec3 e2 = triangle.vertices_[2] - v0;
+		pack.v0x_[lane] = v0.x; pack.v0y_[lane] = v0.y; pack.v0z_[lane] = v0.z;
+		pack.e1x_[lane] = e1.x; pack.e1y_[lane] = e1.y; pack.e1z_[lane] = e1.z;
+		pack.e2x_[lane] = e2.x; pack.e2y_[lane] = e2.y; pack.e2z_[lane] = e2.z;
+	}
+
+	template <typename Pack>
+	void transposeTriangles(const std::vector<MeshQuery::Triangle>& prims, std::vector<Pack>& packs)
+	{
+		const size_t N = Pack::WIDTH;
+		packs.assign((prims.size() + N - 1) / N, Pack());
+		for (size_t i = 0; i < prims.size(); i++) {
+			storeTriangle(packs[i / N], i % N, prims[i]);
+		}
+	}
+}
+
+bool MeshQuery::AccelerationStructure::intersect(const Ray & r, const AABB & aabb) const
+{
+	//Whole line through the ray, behind the origin included
+	float tEntry;
+	return intersect(RayPrecomp(r, std::numeric_limits<float>::lowest(), std::numeric_limits<float>::max()), aabb, tEntry);
 }
 
 bool MeshQuery::AccelerationStructure::intersect(const Ray & r, const Triangle & triangle, float & t) const
+{
+	float u, v;
+	return intersect(r, triangle, t, u, v);
+}
+
+bool MeshQuery::AccelerationStructure::intersect(const Ray & r, const Triangle & triangle, float & t, float & u, float & v) const
 {
 	const glm::vec3 v0v1 = triangle.vertices_[1] - triangle.vertices_[0];
 	const glm::vec3 v0v2 = triangle.vertices_[2] - triangle.vertices_[0];
-	glm::vec3 pVec = glm::cross(r.direction_, v0v2);
+	const glm::vec3 pVec = glm::cross(r.direction_, v0v2);
 	const float det = glm::dot(v0v1, pVec);
 
-	if (std::fabs(det) < std::numeric_limits<float>::max())
+	//Ray parallel to the triangle plane
+	if (std::fabs(det) < std::numeric_limits<float>::min())
 	{
 		return false;
 	}
@@ -63,17 +238,18 @@ bool MeshQuery::AccelerationStructure::intersect(const Ray & r, const Triangle &
 	const float invDet = 1.0f / det;
 
 	const glm::vec3 tVec = r.origin_ - triangle.vertices_[0];
-	const float u = glm::dot(tVec, pVec) * invDet;
+	u = glm::dot(tVec, pVec) * invDet;
 
-	if (u < 0.0f || u > 1.0f)
+	//Written so that NaNs from degenerate triangles fail the test as well
+	if (!(u >= 0.0f && u <= 1.0f))
 	{
 		return false;
 	}
 
 	const glm::vec3 qVec = glm::cross(tVec, v0v1);
-	const float v = glm::dot(r.direction_, qVec) * invDet;
+	v = glm::dot(r.direction_, qVec) * invDet;
 
-	if (v < 0.0f || u + v > 1.0f)
+	if (!(v >= 0.0f && u + v <= 1.0f))
 	{
 		return false;
 	}
@@ -83,6 +259,66 @@ bool MeshQuery::AccelerationStructure::intersect(const Ray & r, const Triangle &
 	return true;
 }
 
+MeshQuery::WatertightRay::WatertightRay(const Ray & r) : origin_(r.origin_)
+{
+	const glm::vec3 absDir = glm::abs(r.direction_);
+	kz_ = absDir.x > absDir.y ? (absDir.x > absDir.z ? 0 : 2) : (absDir.y > absDir.z ? 1 : 2);
+	kx_ = (kz_ + 1) % 3;
+	ky_ = (kx_ + 1) % 3;
+
+	//Keeps the winding of the triangles, so the sign of the edge functions still tells the facing
+	if (r.direction_[kz_] < 0.0f)
+		std::swap(kx_, ky_);
+
+	sx_ = r.direction_[kx_] / r.direction_[kz_];
+	sy_ = r.direction_[ky_] / r.direction_[kz_];
+	sz_ = 1.0f / r.direction_[kz_];
+}
+
+bool MeshQuery::AccelerationStructure::intersect(const WatertightRay & r, const Triangle & triangle, float & t, float & u, float & v) const
+{
+	//Vertices relative to the origin, sheared and permuted so the ray runs along +z through (0, 0)
+	const glm::vec3 a = triangle.vertices_[0] - r.origin_;
+	const glm::vec3 b = triangle.vertices_[1] - r.origin_;
+	const glm::vec3 c = triangle.vertices_[2] - r.origin_;
+
+	const float ax = a[r.kx_] - r.sx_ * a[r.kz_], ay = a[r.ky_] - r.sy_ * a[r.kz_];
+	const float bx = b[r.kx_] - r.sx_ * b[r.kz_], by = b[r.ky_] - r.sy_ * b[r.kz_];
+	const float cx = c[r.kx_] - r.sx_ * c[r.kz_], cy = c[r.ky_] - r.sy_ * c[r.kz_];
+
+	//Scaled barycentrics as 2D edge functions
+	float eu = cx * by - cy * bx;
+	float ev = ax * cy - ay * cx;
+	float ew = bx * ay - by * ax;
+
+	//A ray exactly on an edge in float precision, double decides which side it falls on consistently
+	if (eu == 0.0f || ev == 0.0f || ew == 0.0f)
+	{
+		eu = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+		ev = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+		ew = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+	}
+
+	if ((eu < 0.0f || ev < 0.0f || ew < 0.0f) && (eu > 0.0f || ev > 0.0f || ew > 0.0f))
+	{
+		return false;
+	}
+
+	const float det = eu + ev + ew;
+	if (det == 0.0f)
+	{
+		return false;
+	}
+
+	const float az = r.sz_ * a[r.kz_], bz = r.sz_ * b[r.kz_], cz = r.sz_ * c[r.kz_];
+	const float invDet = 1.0f / det;
+	t = (eu * az + ev * bz + ew * cz) * invDet;
+	u = ev * invDet;
+	v = ew * invDet;
+
+	return true;
+}
+
 void MeshQuery::Octree::buildTree(OctreeNode * node)
 {
 	for (size_t i = 0; i != OctreeNode::NUM_CHILDREN; i++)
@@ -136,80 +372,1898 @@ void MeshQuery::Octree::insertTriangle(OctreeNode * node, Triangle t)
 	}
 }
 
-MeshQuery::BVH::BVH(const std::vector<Triangle>& prims, BvhStrategy strategy) :prims_(prims), strategy_(strategy)
+bool MeshQuery::Octree::occluded(const OctreeNode * node, const Ray & r, float tMax) const
+{
+	return occluded(node, r, RayPrecomp(r, 0.0f, tMax));
+}
+
+bool MeshQuery::Octree::occluded(const OctreeNode * node, const Ray & r, const RayPrecomp & precomp) const
+{
+	float tEntry;
+	if (node == nullptr || !intersect(precomp, node->aabb_, tEntry))
+		return false;
+
+	//Triangles are not always moved out of interior nodes by insertTriangle, so every visited list is tested
+	for (const Triangle& triangle : node->objectList_)
+	{
+		float t, u, v;
+		if (intersect(r, triangle, t, u, v) && t > 0.0f && t < precomp.tMax_)
+			return true;
+	}
+
+	for (size_t i = 0; i != OctreeNode::NUM_CHILDREN; i++)
+	{
+		if (occluded(node->child_[i].get(), r, precomp))
+			return true;
+	}
+
+	return false;
+}
+
+void MeshQuery::BvhNodeArena::reset(size_t capacity)
+{
+	overflowBlocks_.clear();
+	overflowBlockSize_ = overflowUsed_ = overflowSize_ = 0;
+	nodes_.reset(capacity > 0 ? new BvhNode[capacity] : nullptr);
+	capacity_ = capacity;
+	used_.store(0);
+}
+
+MeshQuery::BvhNode * MeshQuery::BvhNodeArena::allocate()
+{
+	size_t index = used_.fetch_add(1, std::memory_order_relaxed);
+	if (index < capacity_) {
+		nodes_[index] = BvhNode();
+		return &nodes_[index];
+	}
+
+	//Only reached when the capacity bound was too small, e.g. for nodes added after the build
+	std::lock_guard<std::mutex> lock(overflowMutex_);
+	if (overflowUsed_ == overflowBlockSize_) {
+		overflowBlockSize_ = std::max(capacity_ / 2, size_t(MIN_OVERFLOW_BLOCK));
+		overflowBlocks_.emplace_back(new BvhNode[overflowBlockSize_]);
+		overflowUsed_ = 0;
+	}
+
+	BvhNode* node = &overflowBlocks_.back()[overflowUsed_++];
+	*node = BvhNode();
+	overflowSize_++;
+	return node;
+}
+
+MeshQuery::BVH::BVH(const std::vector<Triangle>& prims, BvhStrategy strategy, const BvhBuildSettings& settings) :prims_(prims), strategy_(strategy), settings_(settings)
 {
+	//Leaf sizes end up in the 16 bit nPrims_ of the traversal layouts
+	settings_.maxPrimsInNode_ = std::max<size_t>(1, std::min(settings_.maxPrimsInNode_, size_t(LinearBvhNode::MAX_PRIMS)));
+	settings_.leafPrims_ = std::max<size_t>(1, std::min(settings_.leafPrims_, size_t(LinearBvhNode::MAX_PRIMS)));
+
 	std::vector<PrimitiveInfo> primInfo(prims.size());
 	for (size_t i = 0; i < prims.size(); i++)
 	{
 		primInfo[i] = { i, prims[i].aabb_ };
 	}
 
-	std::vector<Triangle> orderedPrims(prims.size());
-	int totalNodes = 0;
+	if (settings_.earlySplitThreshold_ > 0.0f)
+		earlySplit(primInfo);
+
+	//One slot per reference, early split triangles show up in several leaves
+	std::vector<Triangle> orderedPrims(primInfo.size());
+	primIndices_.resize(primInfo.size());
+	std::atomic<int> totalNodes(0);
+
+	//A binary tree over n references with non empty leaves has at most 2n-1 nodes, Sbvh adds its split budget to n
+	size_t maxRefs = primInfo.size();
+	if (strategy_ == Sbvh)
+		maxRefs += static_cast<size_t>(static_cast<float>(prims.size()) * settings_.sbvhDuplicationBudget_);
+	nodes_.reset(maxRefs > 0 ? 2 * maxRefs - 1 : 0);
+
+	if (strategy_ == Hlbvh) {
+		root_ = hlbvhBuild(primInfo, &totalNodes, orderedPrims);
+	}
+	else if (strategy_ == Ploc) {
+		root_ = plocBuild(primInfo, &totalNodes, orderedPrims);
+	}
+	else if (strategy_ == Sbvh) {
+		//References get duplicated, so leaves append instead of owning a fixed range
+		orderedPrims.clear();
+		primIndices_.clear();
+
+		AABB bounds;
+		for (const auto& prim : primInfo) {
+			bounds = Union(bounds, prim.aabb_);
+		}
+
+		int64_t refsLeft = static_cast<int64_t>(static_cast<float>(prims.size()) * settings_.sbvhDuplicationBudget_);
+		if (!primInfo.empty())
+			root_ = recursiveBuildSbvh(primInfo, bounds.surfaceArea(), &totalNodes, orderedPrims, &refsLeft);
+		else
+			root_ = nullptr;
+	}
+	else
+		root_ = recursiveBuild(primInfo, 0, static_cast<int>(primInfo.size()), &totalNodes, orderedPrims);
+
+	//Leaves index into the primitives in build order
+	prims_.swap(orderedPrims);
 
-	root_ = recursiveBuild(primInfo, 0, prims.size(), &totalNodes, orderedPrims);
+	for (size_t pass = 0; pass < settings_.treeletPasses_; pass++)
+		restructureTreelets();
+
+	totalNodes_ = totalNodes.load();
+	nextPrimId_ = static_cast<uint32_t>(prims.size());
+	updateLayouts();
 }
 
-MeshQuery::BvhNode * MeshQuery::BVH::recursiveBuild(std::vector<PrimitiveInfo>& primInfo, int start, int end, int* totalNodes, std::vector<Triangle>& orderedPrims)
+void MeshQuery::BVH::updateLayouts()
 {
-	if (start == end)
-		return nullptr;
+	if (layoutStale_) {
+		//Removed primitives leave holes and inserted ones are appended, store the leaves back to back again
+		std::vector<Triangle> prims;
+		std::vector<uint32_t> primIndices;
+		prims.reserve(prims_.size());
+		primIndices.reserve(primIndices_.size());
 
-	BvhNode* node = new BvhNode();
-	(*totalNodes)++;
+		std::function<void(BvhNode*)> compact = [&](BvhNode* node) {
+			if (node->nPrims_ == 0) {
+				compact(node->children_[0]);
+				compact(node->children_[1]);
+				return;
+			}
 
-	AABB bounds;
-	for (int i = start; i < end; i++) {
-		bounds = Union(bounds, primInfo[i].aabb_);
+			size_t offset = prims.size();
+			for (size_t i = node->firstPrimOffset_; i < node->firstPrimOffset_ + node->nPrims_; i++) {
+				prims.push_back(prims_[i]);
+				primIndices.push_back(primIndices_[i]);
+			}
+			node->firstPrimOffset_ = offset;
+		};
+
+		if (root_ != nullptr)
+			compact(root_);
+		prims_.swap(prims);
+		primIndices_.swap(primIndices);
 	}
 
-	int numOfPrims = end - start;
-	if (numOfPrims == 1) {
-		int offset = orderedPrims.size();
-		for (int i = start; i < end; i++) {
-			orderedPrims.push_back(prims_[primInfo[i].primNum_]);
+	linearNodes_.resize(totalNodes_);
+	parents_.resize(totalNodes_);
+	flattenedNodes_.resize(totalNodes_);
+	uint32_t offset = 0;
+	if (root_ != nullptr)
+		flattenBvhTree(root_, &offset, NO_PARENT);
+
+	buildWideLayouts();
+	buildTrianglePacks();
+	layoutStale_ = false;
+}
+
+MeshQuery::BvhQualityReport MeshQuery::BVH::getQualityReport() const
+{
+	BvhQualityReport report;
+	report.nodeCount_ = totalNodes_;
+	report.treeBytes_ = nodes_.bytes();
+	report.layoutBytes_ = linearNodes_.capacity() * sizeof(LinearBvhNode) + parents_.capacity() * sizeof(uint32_t) +
+		(flattenedNodes_.capacity() + wideSources_.capacity()) * sizeof(BvhNode*) +
+		wideNodes4_.capacity() * sizeof(WideBvhNode<4>) + wideNodes8_.capacity() * sizeof(WideBvhNode<8>) +
+		quantizedNodes4_.capacity() * sizeof(QuantizedBvhNode<4>) + quantizedNodes8_.capacity() * sizeof(QuantizedBvhNode<8>);
+	report.primitiveBytes_ = prims_.capacity() * sizeof(Triangle) + primIndices_.capacity() * sizeof(uint32_t) +
+		trianglePacks4_.capacity() * sizeof(TrianglePack<4>) + trianglePacks8_.capacity() * sizeof(TrianglePack<8>);
+
+	if (root_ == nullptr)
+		return report;
+
+	const float rootArea = root_->aabb_.surfaceArea();
+	size_t depthSum = 0;
+	std::vector<std::pair<const BvhNode*, size_t>> stack(1, { root_, 0 });
+	while (!stack.empty()) {
+		const BvhNode* node = stack.back().first;
+		size_t depth = stack.back().second;
+		stack.pop_back();
+
+		//Flat or point sized roots have no area to be relative to, every node then counts as always visited
+		float area = rootArea > 0.0f ? node->aabb_.surfaceArea() / rootArea : 1.0f;
+		if (node->nPrims_ > 0) {
+			report.sahCost_ += settings_.intersectionCost_ * static_cast<float>(node->nPrims_) * area;
+			report.leafCount_++;
+			depthSum += depth;
+			report.maxDepth_ = std::max(report.maxDepth_, depth);
+			if (report.depthHistogram_.size() <= depth)
+				report.depthHistogram_.resize(depth + 1, 0);
+			report.depthHistogram_[depth]++;
+			if (report.leafSizeHistogram_.size() <= node->nPrims_)
+				report.leafSizeHistogram_.resize(node->nPrims_ + 1, 0);
+			report.leafSizeHistogram_[node->nPrims_]++;
+			continue;
 		}
-		node->initLeaf(offset, numOfPrims, bounds);
-		return node;
+
+		report.sahCost_ += settings_.traversalCost_ * area;
+
+		const AABB& a = node->children_[0]->aabb_;
+		const AABB& b = node->children_[1]->aabb_;
+		glm::vec3 overlap = min(a.max_, b.max_) - max(a.min_, b.min_);
+		if (overlap.x > 0.0f && overlap.y > 0.0f && overlap.z > 0.0f)
+			report.siblingOverlap_ += overlap.x * overlap.y * overlap.z;
+
+		stack.push_back({ node->children_[0], depth + 1 });
+		stack.push_back({ node->children_[1], depth + 1 });
 	}
-	else {
-		AABB centroidBounds;
-		for (int i = start; i < end; i++) {
-			centroidBounds = Union(centroidBounds, primInfo[i].centroid_);
+
+	report.averageLeafDepth_ = static_cast<float>(depthSum) / static_cast<float>(report.leafCount_);
+	return report;
+}
+
+MeshQuery::BvhNode * MeshQuery::BVH::allocateNode()
+{
+	if (freeNodes_.empty())
+		return nodes_.allocate();
+
+	BvhNode* node = freeNodes_.back();
+	freeNodes_.pop_back();
+	*node = BvhNode();
+	return node;
+}
+
+MeshQuery::BvhNode * MeshQuery::BVH::findBestSibling(const AABB & bounds) const
+{
+	struct Candidate
+	{
+		BvhNode* node_;
+		float inheritedCost_;	//area growth of the ancestors if the new leaf goes below this node
+	};
+
+	const float leafArea = bounds.surfaceArea();
+	BvhNode* best = root_;
+	float bestCost = Union(root_->aabb_, bounds).surfaceArea();
+
+	std::vector<Candidate> stack(1, { root_, 0.0f });
+	while (!stack.empty()) {
+		Candidate candidate = stack.back();
+		stack.pop_back();
+
+		BvhNode* node = candidate.node_;
+		float mergedArea = Union(node->aabb_, bounds).surfaceArea();
+		float cost = mergedArea + candidate.inheritedCost_;
+		if (cost < bestCost) {
+			best = node;
+			bestCost = cost;
 		}
 
-		int axis = centroidBounds.getDominantAxis();
-		int mid = (start + end) / 2;
-		//We dont have any volume so we should stop the recursion
-		if (centroidBounds.min_[axis] == centroidBounds.max_[axis]) {
-			int offset = orderedPrims.size();
-			for (int i = start; i < end; i++) {
-				orderedPrims.push_back(prims_[primInfo[i].primNum_]);
+		//Anything below pays at least the new leaf's own area on top of what this node inherits
+		float inheritedCost = candidate.inheritedCost_ + mergedArea - node->aabb_.surfaceArea();
+		if (node->nPrims_ == 0 && leafArea + inheritedCost < bestCost) {
+			stack.push_back({ node->children_[0], inheritedCost });
+			stack.push_back({ node->children_[1], inheritedCost });
+		}
+	}
+
+	return best;
+}
+
+void MeshQuery::BVH::rotate(BvhNode * node)
+{
+	if (node->nPrims_ > 0)
+		return;
+
+	//Child i of node swaps with grandchild j below the other child, only the other child's bounds change
+	int bestChild = -1, bestGrandchild = -1;
+	float bestGain = 0.0f;
+	for (int i = 0; i < 2; i++) {
+		BvhNode* child = node->children_[i];
+		BvhNode* other = node->children_[1 - i];
+		if (other->nPrims_ > 0)
+			continue;
+
+		for (int j = 0; j < 2; j++) {
+			float gain = other->aabb_.surfaceArea() - Union(child->aabb_, other->children_[1 - j]->aabb_).surfaceArea();
+			if (gain > bestGain) {
+				bestGain = gain;
+				bestChild = i;
+				bestGrandchild = j;
 			}
-			node->initLeaf(offset, numOfPrims, bounds);
-			return node;
 		}
-		else {
-			//ToDo add other methods later on currently only midpoint
-			float midPt = (centroidBounds.min_[axis] + centroidBounds.max_[axis]) / 2;
+	}
 
-			PrimitiveInfo* midPtr = std::partition(&primInfo[start],
-				&primInfo[end - 1] + 1,
-				[axis, midPt](const PrimitiveInfo& prim) {
-				return prim.centroid_[axis] < midPt;
-			});
+	if (bestChild < 0)
+		return;
+
+	BvhNode* child = node->children_[bestChild];
+	BvhNode* other = node->children_[1 - bestChild];
+	BvhNode* grandchild = other->children_[bestGrandchild];
+	BvhNode* kept = other->children_[1 - bestGrandchild];
+
+	node->children_[bestChild] = grandchild;
+	grandchild->parent_ = node;
+	other->initInterior(separatingAxis(child->aabb_, kept->aabb_), child, kept);
+}
+
+void MeshQuery::BVH::refitAncestors(BvhNode * node)
+{
+	for (; node != nullptr; node = node->parent_) {
+		node->aabb_ = Union(node->children_[0]->aabb_, node->children_[1]->aabb_);
+		rotate(node);
+	}
+}
+
+uint32_t MeshQuery::BVH::insert(const Triangle & triangle)
+{
+	uint32_t primId = nextPrimId_++;
+	prims_.push_back(triangle);
+	primIndices_.push_back(primId);
+	layoutStale_ = true;
+
+	BvhNode* leaf = allocateNode();
+	leaf->initLeaf(static_cast<int>(prims_.size() - 1), 1, triangle.aabb_);
+	totalNodes_++;
+	if (leavesIndexed_)
+		primLeaves_.emplace(primId, leaf);
+
+	if (root_ == nullptr) {
+		root_ = leaf;
+		return primId;
+	}
+
+	BvhNode* sibling = findBestSibling(triangle.aabb_);
+	BvhNode* oldParent = sibling->parent_;
+	BvhNode* parent = allocateNode();
+	totalNodes_++;
+	parent->initInterior(separatingAxis(sibling->aabb_, leaf->aabb_), sibling, leaf);
+	parent->parent_ = oldParent;
+
+	if (oldParent == nullptr)
+		root_ = parent;
+	else
+		oldParent->children_[oldParent->children_[0] == sibling ? 0 : 1] = parent;
+
+	refitAncestors(oldParent);
+	return primId;
+}
+
+bool MeshQuery::BVH::remove(uint32_t primId)
+{
+	if (!leavesIndexed_) {
+		std::function<void(BvhNode*)> index = [&](BvhNode* node) {
+			if (node->nPrims_ == 0) {
+				index(node->children_[0]);
+				index(node->children_[1]);
+				return;
+			}
+
+			for (size_t i = node->firstPrimOffset_; i < node->firstPrimOffset_ + node->nPrims_; i++) {
+				primLeaves_.emplace(primIndices_[i], node);
+			}
+		};
+
+		primLeaves_.clear();
+		if (root_ != nullptr)
+			index(root_);
+		leavesIndexed_ = true;
+	}
+
+	//Split references of one triangle can share a leaf
+	auto range = primLeaves_.equal_range(primId);
+	std::vector<BvhNode*> leaves;
+	for (auto it = range.first; it != range.second; ++it) {
+		leaves.push_back(it->second);
+	}
+	primLeaves_.erase(range.first, range.second);
 
-			mid = midPtr - &primInfo[0];
+	if (leaves.empty())
+		return false;
+
+	std::sort(leaves.begin(), leaves.end());
+	leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
 
-			if (mid == start || mid == end) {
-				//ToDo currently undesired till we implement another methods
-				printf("I shouldnt come here!");
+	for (BvhNode* leaf : leaves) {
+		size_t end = leaf->firstPrimOffset_ + leaf->nPrims_;
+		for (size_t i = leaf->firstPrimOffset_; i < end;) {
+			if (primIndices_[i] == primId) {
+				end--;
+				std::swap(prims_[i], prims_[end]);
+				std::swap(primIndices_[i], primIndices_[end]);
 			}
+			else
+				i++;
+		}
+		leaf->nPrims_ = end - leaf->firstPrimOffset_;
+
+		if (leaf->nPrims_ == 0) {
+			removeLeaf(leaf);
+			continue;
+		}
 
-			node->initInterior(axis, recursiveBuild(primInfo, start, mid, totalNodes, orderedPrims),
-				recursiveBuild(primInfo, mid, end, totalNodes, orderedPrims));
+		//Whole triangle boxes of split references can stick out of the old leaf, which already bounds their parts
+		AABB bounds;
+		for (size_t i = leaf->firstPrimOffset_; i < end; i++) {
+			bounds = Union(bounds, prims_[i].aabb_);
 		}
+		leaf->aabb_.min_ = max(bounds.min_, leaf->aabb_.min_);
+		leaf->aabb_.max_ = min(bounds.max_, leaf->aabb_.max_);
+		refitAncestors(leaf->parent_);
 	}
 
-	return node;
+	layoutStale_ = true;
+	return true;
+}
+
+void MeshQuery::BVH::removeLeaf(BvhNode * leaf)
+{
+	BvhNode* parent = leaf->parent_;
+	freeNodes_.push_back(leaf);
+	totalNodes_--;
+	if (parent == nullptr) {
+		root_ = nullptr;
+		return;
+	}
+
+	BvhNode* sibling = parent->children_[parent->children_[0] == leaf ? 1 : 0];
+	BvhNode* grandparent = parent->parent_;
+	sibling->parent_ = grandparent;
+	if (grandparent == nullptr)
+		root_ = sibling;
+	else
+		grandparent->children_[grandparent->children_[0] == parent ? 0 : 1] = sibling;
+
+	freeNodes_.push_back(parent);
+	totalNodes_--;
+	refitAncestors(grandparent);
+}
+
+void MeshQuery::BVH::buildWideLayouts()
+{
+	wideNodes4_.clear();
+	wideNodes8_.clear();
+	quantizedNodes4_.clear();
+	quantizedNodes8_.clear();
+	wideSources_.clear();
+
+	if (root_ != nullptr && settings_.width_ == 4)
+		collapseBvhTree(root_, wideNodes4_, &wideSources_);
+	else if (root_ != nullptr && settings_.width_ == 8)
+		collapseBvhTree(root_, wideNodes8_, &wideSources_);
+
+	if (settings_.quantize_) {
+		quantizeWideNodes(wideNodes4_, quantizedNodes4_);
+		quantizeWideNodes(wideNodes8_, quantizedNodes8_);
+		wideNodes4_ = std::vector<WideBvhNode<4>>();
+		wideNodes8_ = std::vector<WideBvhNode<8>>();
+	}
+}
+
+uint32_t MeshQuery::BVH::flattenBvhTree(BvhNode * node, uint32_t * offset, uint32_t parent)
+{
+	LinearBvhNode* linearNode = &linearNodes_[*offset];
+	linearNode->aabb_ = node->aabb_;
+	linearNode->pad_ = 0;
+	uint32_t myOffset = (*offset)++;
+	parents_[myOffset] = parent;
+	flattenedNodes_[myOffset] = node;
+
+	if (node->nPrims_ > 0) {
+		linearNode->primitivesOffset_ = static_cast<uint32_t>(node->firstPrimOffset_);
+		linearNode->nPrims_ = static_cast<uint16_t>(node->nPrims_);
+		linearNode->axis_ = 0;
+	}
+	else {
+		linearNode->axis_ = static_cast<uint8_t>(node->splitAxis_);
+		linearNode->nPrims_ = 0;
+		flattenBvhTree(node->children_[0], offset, myOffset);
+		linearNode->secondChildOffset_ = flattenBvhTree(node->children_[1], offset, myOffset);
+	}
+
+	return myOffset;
+}
+
+bool MeshQuery::BVH::intersect(const Ray & r, Hit & hit) const
+{
+	//Only the watertight test needs the sheared ray, the default path stays division free
+	std::optional<WatertightRay> watertight;
+	if (settings_.watertight_)
+		watertight.emplace(r);
+
+	bool found = false;
+	traverse(r, std::numeric_limits<float>::max(), [&](uint32_t offset, uint32_t nPrims, float& tMax) {
+		found = intersectLeaf(r, watertight ? &*watertight : nullptr, offset, nPrims, tMax, &hit) || found;
+		return false;
+	});
+
+	return found;
+}
+
+bool MeshQuery::BVH::occluded(const Ray & r, float tMax) const
+{
+	if (linearNodes_.empty())
+		return false;
+
+	const RayPrecomp precomp(r, 0.0f, tMax);
+	std::optional<WatertightRay> watertight;
+	if (settings_.watertight_)
+		watertight.emplace(r);
+
+	TraversalStack<uint32_t, 64> stack;
+	uint32_t current = 0;
+
+	while (true) {
+		const LinearBvhNode& node = linearNodes_[current];
+		float tEntry;
+		if (intersect(precomp, node.aabb_, tEntry)) {
+			//Any hit will do, so children go in layout order
+			if (node.nPrims_ == 0) {
+				stack.push(node.secondChildOffset_);
+				current = current + 1;
+				continue;
+			}
+
+			if (intersectLeaf(r, watertight ? &*watertight : nullptr, node.primitivesOffset_, node.nPrims_, tMax, nullptr))
+				return true;
+		}
+
+		if (stack.empty())
+			return false;
+		current = stack.pop();
+	}
+}
+
+template <typename Pack>
+bool MeshQuery::BVH::intersectPacks(const std::vector<Pack>& packs, const Ray & r, uint32_t offset, uint32_t nPrims, float & tMax, Hit * hit) const
+{
+	const uint32_t N = Pack::WIDTH;
+	bool found = false;
+	for (uint32_t p = offset / N; p <= (offset + nPrims - 1) / N; p++) {
+		//Leaves do not start on pack boundaries, only the lanes inside [offset, offset + nPrims) are tested
+		const uint32_t first = std::max(offset, p * N) - p * N;
+		const uint32_t last = std::min(offset + nPrims, (p + 1) * N) - p * N;
+		const int laneMask = ((1 << last) - 1) & ~((1 << first) - 1);
+
+		float t, u, v;
+		const int lane = packs[p].intersect(r, laneMask, tMax, t, u, v);
+		if (lane < 0)
+			continue;
+		if (hit == nullptr)
+			return true;
+
+		tMax = t;
+		hit->primId_ = primIndices_[p * N + lane];
+		hit->t_ = t;
+		hit->u_ = u;
+		hit->v_ = v;
+		found = true;
+	}
+
+	return found;
+}
+
+bool MeshQuery::BVH::intersectLeaf(const Ray & r, const WatertightRay * watertight, uint32_t offset, uint32_t nPrims, float & tMax, Hit * hit) const
+{
+	if (!trianglePacks8_.empty())
+		return intersectPacks(trianglePacks8_, r, offset, nPrims, tMax, hit);
+	if (!trianglePacks4_.empty())
+		return intersectPacks(trianglePacks4_, r, offset, nPrims, tMax, hit);
+
+	bool found = false;
+	for (uint32_t i = offset; i < offset + nPrims; i++) {
+		float t, u, v;
+		const bool hitTriangle = watertight != nullptr ? intersect(*watertight, prims_[i], t, u, v) : intersect(r, prims_[i], t, u, v);
+		if (!hitTriangle || !(t > 0.0f && t < tMax))
+			continue;
+		if (hit == nullptr)
+			return true;
+
+		tMax = t;
+		hit->primId_ = primIndices_[i];
+		hit->t_ = t;
+		hit->u_ = u;
+		hit->v_ = v;
+		found = true;
+	}
+
+	return found;
+}
+
+void MeshQuery::BVH::buildTrianglePacks()
+{
+	trianglePacks4_.clear();
+	trianglePacks8_.clear();
+
+	if (settings_.watertight_)
+		return;
+
+	if (settings_.trianglePackWidth_ == 4)
+		transposeTriangles(prims_, trianglePacks4_);
+	else if (settings_.trianglePackWidth_ == 8)
+		transposeTriangles(prims_, trianglePacks8_);
+}
+
+void MeshQuery::BVH::refit(const std::vector<Triangle>& prims)
+{
+	if (layoutStale_)
+		updateLayouts();
+
+	if (linearNodes_.empty())
+		return;
+
+	//Second thread to reach a parent has both child boxes and carries on up, the first one stops there
+	std::vector<std::atomic<uint32_t>> visits(linearNodes_.size());
+	for (auto& v : visits) {
+		v.store(0, std::memory_order_relaxed);
+	}
+
+	const size_t chunkSize = 1024;
+	TaskPool::instance().parallelFor((linearNodes_.size() + chunkSize - 1) / chunkSize, [&](size_t c) {
+		for (size_t i = c * chunkSize; i < std::min(linearNodes_.size(), (c + 1) * chunkSize); i++) {
+			LinearBvhNode& leaf = linearNodes_[i];
+			if (leaf.nPrims_ == 0)
+				continue;
+
+			AABB bounds;
+			for (uint32_t p = leaf.primitivesOffset_; p < leaf.primitivesOffset_ + leaf.nPrims_; p++) {
+				prims_[p] = prims[primIndices_[p]];
+				bounds = Union(bounds, prims_[p].aabb_);
+
+				//Packs straddle leaves, but every thread only writes the lanes of its own primitives
+				if (!trianglePacks4_.empty())
+					storeTriangle(trianglePacks4_[p / 4], p % 4, prims_[p]);
+				else if (!trianglePacks8_.empty())
+					storeTriangle(trianglePacks8_[p / 8], p % 8, prims_[p]);
+			}
+			leaf.aabb_ = bounds;
+
+			for (uint32_t node = parents_[i]; node != NO_PARENT; node = parents_[node]) {
+				if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0)
+					break;
+
+				LinearBvhNode& interior = linearNodes_[node];
+				interior.aabb_ = Union(linearNodes_[node + 1].aabb_, linearNodes_[interior.secondChildOffset_].aabb_);
+			}
+		}
+	});
+
+	TaskPool::instance().parallelFor((linearNodes_.size() + chunkSize - 1) / chunkSize, [&](size_t c) {
+		for (size_t i = c * chunkSize; i < std::min(linearNodes_.size(), (c + 1) * chunkSize); i++) {
+			flattenedNodes_[i]->aabb_ = linearNodes_[i].aabb_;
+		}
+	});
+
+	refitWideLayouts();
+}
+
+void MeshQuery::BVH::refitWideLayouts()
+{
+	refitWideNodes(wideNodes4_);
+	refitWideNodes(wideNodes8_);
+	refitQuantizedNodes(quantizedNodes4_);
+	refitQuantizedNodes(quantizedNodes8_);
+}
+
+template <int N>
+void MeshQuery::BVH::refitWideNodes(std::vector<WideBvhNode<N>>& nodes) const
+{
+	TaskPool::instance().parallelFor(nodes.size(), [&](size_t n) {
+		WideBvhNode<N>& wide = nodes[n];
+		for (int i = 0; i < wide.nChildren_; i++) {
+			const AABB& b = wideSources_[n * N + i]->aabb_;
+			wide.minX_[i] = b.min_.x; wide.minY_[i] = b.min_.y; wide.minZ_[i] = b.min_.z;
+			wide.maxX_[i] = b.max_.x; wide.maxY_[i] = b.max_.y; wide.maxZ_[i] = b.max_.z;
+		}
+	});
+}
+
+template <int N>
+void MeshQuery::BVH::refitQuantizedNodes(std::vector<QuantizedBvhNode<N>>& nodes) const
+{
+	TaskPool::instance().parallelFor(nodes.size(), [&](size_t n) {
+		//The float node was dropped after quantizing, rebuild it from the build tree and quantize it again
+		QuantizedBvhNode<N>& q = nodes[n];
+		WideBvhNode<N> wide;
+		wide.nChildren_ = q.nChildren_;
+		for (int i = 0; i < N; i++) {
+			const AABB& b = i < q.nChildren_ ? wideSources_[n * N + i]->aabb_ : AABB();
+			wide.minX_[i] = b.min_.x; wide.minY_[i] = b.min_.y; wide.minZ_[i] = b.min_.z;
+			wide.maxX_[i] = b.max_.x; wide.maxY_[i] = b.max_.y; wide.maxZ_[i] = b.max_.z;
+			wide.child_[i] = q.child_[i];
+			wide.nPrims_[i] = q.nPrims_[i];
+		}
+		quantizeWideNode(wide, q);
+	});
+}
+
+void MeshQuery::BVH::optimizeTreelets()
+{
+	restructureTreelets();
+	updateLayouts();
+}
+
+void MeshQuery::BVH::restructureTreelets()
+{
+	if (root_ == nullptr || root_->nPrims_ > 0)
+		return;
+
+	computeSubtreeCost(root_);
+
+	//Treelets rooted on the same level are disjoint, deeper levels go first so their costs are final
+	std::vector<std::vector<BvhNode*>> levels(1, std::vector<BvhNode*>(1, root_));
+	while (true) {
+		std::vector<BvhNode*> next;
+		for (BvhNode* node : levels.back()) {
+			for (BvhNode* child : node->children_) {
+				if (child->nPrims_ == 0)
+					next.push_back(child);
+			}
+		}
+
+		if (next.empty())
+			break;
+		levels.push_back(std::move(next));
+	}
+
+	for (auto level = levels.rbegin(); level != levels.rend(); ++level) {
+		const std::vector<BvhNode*>& nodes = *level;
+		TaskPool::instance().parallelFor(nodes.size(), [&](size_t i) {
+			restructureTreelet(nodes[i]);
+		});
+	}
+}
+
+float MeshQuery::BVH::computeSubtreeCost(BvhNode * node)
+{
+	if (node->nPrims_ > 0)
+		node->sahCost_ = settings_.intersectionCost_ * static_cast<float>(node->nPrims_) * node->aabb_.surfaceArea();
+	else
+		node->sahCost_ = settings_.traversalCost_ * node->aabb_.surfaceArea() +
+			computeSubtreeCost(node->children_[0]) + computeSubtreeCost(node->children_[1]);
+
+	return node->sahCost_;
+}
+
+void MeshQuery::BVH::restructureTreelet(BvhNode * root)
+{
+	const int maxLeaves = static_cast<int>(std::max<size_t>(3, std::min(settings_.treeletLeaves_, size_t(MAX_TREELET_LEAVES))));
+
+	//Grow the treelet by opening the leaf with the largest area, the opened nodes get reused for the new topology
+	BvhNode* leaves[MAX_TREELET_LEAVES] = { root->children_[0], root->children_[1] };
+	BvhNode* internals[MAX_TREELET_LEAVES - 1] = { root };
+	int nLeaves = 2, nInternals = 1;
+	while (nLeaves < maxLeaves) {
+		int best = -1;
+		float bestArea = -1.0f;
+		for (int i = 0; i < nLeaves; i++) {
+			if (leaves[i]->nPrims_ == 0 && leaves[i]->aabb_.surfaceArea() > bestArea) {
+				best = i;
+				bestArea = leaves[i]->aabb_.surfaceArea();
+			}
+		}
+
+		if (best < 0)
+			break;
+
+		BvhNode* opened = leaves[best];
+		internals[nInternals++] = opened;
+		leaves[best] = opened->children_[0];
+		leaves[nLeaves++] = opened->children_[1];
+	}
+
+	//Two leaves only have one topology
+	if (nLeaves < 3)
+		return;
+
+	//Treelets below were restructured since the costs were computed, refresh the current topology children first
+	for (int i = nInternals - 1; i >= 0; i--) {
+		BvhNode* node = internals[i];
+		node->sahCost_ = settings_.traversalCost_ * node->aabb_.surfaceArea() + node->children_[0]->sahCost_ + node->children_[1]->sahCost_;
+	}
+
+	const int nSubsets = 1 << nLeaves;
+	float area[1 << MAX_TREELET_LEAVES];
+	float cost[1 << MAX_TREELET_LEAVES];
+	int partition[1 << MAX_TREELET_LEAVES];
+
+	for (int s = 1; s < nSubsets; s++) {
+		AABB bounds;
+		for (int i = 0; i < nLeaves; i++) {
+			if (s & (1 << i))
+				bounds = Union(bounds, leaves[i]->aabb_);
+		}
+		area[s] = bounds.surfaceArea();
+	}
+
+	//Subsets of s are smaller numbers, so increasing order visits them first
+	for (int s = 1; s < nSubsets; s++) {
+		if ((s & (s - 1)) == 0) {
+			int i = 0;
+			while (!(s & (1 << i))) i++;
+			cost[s] = leaves[i]->sahCost_;
+			continue;
+		}
+
+		//Only partitions holding the lowest bit, the mirrored ones cost the same
+		const int lowest = s & -s;
+		float bestCost = std::numeric_limits<float>::max();
+		int bestPartition = 0;
+		for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+			if (!(p & lowest))
+				continue;
+
+			float c = cost[p] + cost[s ^ p];
+			if (c < bestCost) {
+				bestCost = c;
+				bestPartition = p;
+			}
+		}
+
+		cost[s] = settings_.traversalCost_ * area[s] + bestCost;
+		partition[s] = bestPartition;
+	}
+
+	if (cost[nSubsets - 1] >= root->sahCost_)
+		return;
+
+	//Rebuild from the full set down, the first internal node taken is root so its parent stays valid
+	int nextInternal = 0;
+	std::function<BvhNode*(int)> rebuild = [&](int s) -> BvhNode* {
+		if ((s & (s - 1)) == 0) {
+			int i = 0;
+			while (!(s & (1 << i))) i++;
+			return leaves[i];
+		}
+
+		BvhNode* node = internals[nextInternal++];
+		BvhNode* c0 = rebuild(partition[s]);
+		BvhNode* c1 = rebuild(s ^ partition[s]);
+
+		node->initInterior(separatingAxis(c0->aabb_, c1->aabb_), c0, c1);
+		node->sahCost_ = cost[s];
+		return node;
+	};
+
+	rebuild(nSubsets - 1);
+}
+
+template <int N>
+void MeshQuery::BVH::quantizeWideNodes(const std::vector<WideBvhNode<N>>& wideNodes, std::vector<QuantizedBvhNode<N>>& nodes)
+{
+	nodes.resize(wideNodes.size());
+	TaskPool::instance().parallelFor(wideNodes.size(), [&](size_t n) {
+		quantizeWideNode(wideNodes[n], nodes[n]);
+	});
+}
+
+template <int N>
+void MeshQuery::BVH::quantizeWideNode(const WideBvhNode<N>& wide, QuantizedBvhNode<N>& q)
+{
+	AABB bounds;
+	for (int i = 0; i < wide.nChildren_; i++) {
+		bounds = Union(bounds, AABB(glm::vec3(wide.minX_[i], wide.minY_[i], wide.minZ_[i]), glm::vec3(wide.maxX_[i], wide.maxY_[i], wide.maxZ_[i])));
+	}
+
+	q.origin_ = bounds.min_;
+	q.nChildren_ = wide.nChildren_;
+	for (int i = 0; i < N; i++) {
+		q.child_[i] = wide.child_[i];
+		q.nPrims_[i] = wide.nPrims_[i];
+	}
+
+	const float* childMin[3] = { wide.minX_, wide.minY_, wide.minZ_ };
+	const float* childMax[3] = { wide.maxX_, wide.maxY_, wide.maxZ_ };
+	uint8_t* qMin[3] = { q.qMinX_, q.qMinY_, q.qMinZ_ };
+	uint8_t* qMax[3] = { q.qMaxX_, q.qMaxY_, q.qMaxZ_ };
+
+	for (int axis = 0; axis < 3; axis++) {
+		//Power of two scale keeps q * scale exact, so decoding only rounds in the final add
+		const float extent = bounds.max_[axis] - bounds.min_[axis];
+		int exponent = extent > 0.0f ? static_cast<int>(std::ceil(std::log2(extent / 255.0f))) : -126;
+
+		for (;; exponent++) {
+			exponent = std::max(-126, std::min(127, exponent));
+			const float scale = std::ldexp(1.0f, exponent);
+			bool fits = true;
+
+			for (int i = 0; i < N && fits; i++) {
+				if (i >= wide.nChildren_) {
+					//Empty slots are masked out by nChildren_ during traversal
+					qMin[axis][i] = 255;
+					qMax[axis][i] = 0;
+					continue;
+				}
+
+				//Round outwards and step once more if the decoded plane still ends up inside the child
+				int lo = static_cast<int>(std::floor((childMin[axis][i] - q.origin_[axis]) / scale));
+				int hi = static_cast<int>(std::ceil((childMax[axis][i] - q.origin_[axis]) / scale));
+				lo = std::max(0, lo);
+				if (q.origin_[axis] + lo * scale > childMin[axis][i])
+					lo = std::max(0, lo - 1);
+				if (q.origin_[axis] + hi * scale < childMax[axis][i])
+					hi++;
+
+				fits = hi <= 255;
+				qMin[axis][i] = static_cast<uint8_t>(lo);
+				qMax[axis][i] = static_cast<uint8_t>(std::min(hi, 255));
+			}
+
+			if (fits || exponent == 127) {
+				q.exponent_[axis] = static_cast<int8_t>(exponent);
+				break;
+			}
+		}
+	}
+}
+
+namespace
+{
+	//Slab test of four boxes against one ray, returns the hit mask and writes the entry distances
+	inline int slabTest4(const __m128 lo[3], const __m128 hi[3], const glm::vec3& org, const glm::vec3& invDir, float tMax, float* tEntry)
+	{
+		const __m128 tx0 = _mm_mul_ps(_mm_sub_ps(lo[0], _mm_set1_ps(org.x)), _mm_set1_ps(invDir.x));
+		const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(hi[0], _mm_set1_ps(org.x)), _mm_set1_ps(invDir.x));
+		const __m128 ty0 = _mm_mul_ps(_mm_sub_ps(lo[1], _mm_set1_ps(org.y)), _mm_set1_ps(invDir.y));
+		const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(hi[1], _mm_set1_ps(org.y)), _mm_set1_ps(invDir.y));
+		const __m128 tz0 = _mm_mul_ps(_mm_sub_ps(lo[2], _mm_set1_ps(org.z)), _mm_set1_ps(invDir.z));
+		const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(hi[2], _mm_set1_ps(org.z)), _mm_set1_ps(invDir.z));
+
+		const __m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+			_mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+		const __m128 tExit = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_max_ps(tz0, tz1));
+		const __m128 tFar = _mm_min_ps(_mm_mul_ps(tExit, _mm_set1_ps(MeshQuery::RayPrecomp::EXIT_SCALE)), _mm_set1_ps(tMax));
+
+		_mm_storeu_ps(tEntry, tNear);
+		return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+	}
+
+	//Widens four quantized planes to float and decodes them as origin + q * 2^exponent, 2^exponent built from its bits
+	inline __m128 decode4(const uint8_t* q, float origin, int exponent)
+	{
+		int packed;
+		std::memcpy(&packed, q, sizeof(packed));
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+		const __m128 scale = _mm_castsi128_ps(_mm_set1_epi32((exponent + 127) << 23));
+		return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(wide), scale));
+	}
+
+	//Moller-Trumbore on four triangles, the nine SoA planes of the pack start stride floats apart from planes.
+	//Returns the mask of lanes hit in (0, tMax), written so that NaNs from degenerate lanes fail every compare.
+	inline int mollerTrumbore4(const float* planes, size_t stride, const MeshQuery::Ray& r, float tMax, __m128& t, __m128& u, __m128& v)
+	{
+		const __m128 dx = _mm_set1_ps(r.direction_.x), dy = _mm_set1_ps(r.direction_.y), dz = _mm_set1_ps(r.direction_.z);
+		const __m128 v0x = _mm_loadu_ps(planes), v0y = _mm_loadu_ps(planes + stride), v0z = _mm_loadu_ps(planes + 2 * stride);
+		const __m128 e1x = _mm_loadu_ps(planes + 3 * stride), e1y = _mm_loadu_ps(planes + 4 * stride), e1z = _mm_loadu_ps(planes + 5 * stride);
+		const __m128 e2x = _mm_loadu_ps(planes + 6 * stride), e2y = _mm_loadu_ps(planes + 7 * stride), e2z = _mm_loadu_ps(planes + 8 * stride);
+
+		//p = d x e2, det = e1 . p
+		const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+		const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+		const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+		const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		const __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+		const __m128 tx = _mm_sub_ps(_mm_set1_ps(r.origin_.x), v0x);
+		const __m128 ty = _mm_sub_ps(_mm_set1_ps(r.origin_.y), v0y);
+		const __m128 tz = _mm_sub_ps(_mm_set1_ps(r.origin_.z), v0z);
+		u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+		//q = (o - v0) x e1
+		const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(e1y, tz));
+		const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(e1z, tx));
+		const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(e1x, ty));
+		v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+		t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+		const __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+		__m128 hit = _mm_cmpge_ps(absDet, _mm_set1_ps(std::numeric_limits<float>::min()));
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(u, _mm_setzero_ps()));
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(v, _mm_setzero_ps()));
+		hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+		hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, _mm_setzero_ps()));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(t, _mm_set1_ps(tMax)));
+		return _mm_movemask_ps(hit);
+	}
+
+	//Horizontal min of the hit lanes, returns the first lane holding it
+	inline int nearestLane4(__m128 t, int mask)
+	{
+		const __m128 lanes = _mm_castsi128_ps(_mm_set_epi32(8, 4, 2, 1));
+		const __m128 hit = _mm_cmpneq_ps(_mm_and_ps(lanes, _mm_castsi128_ps(_mm_set1_epi32(mask))), _mm_setzero_ps());
+		const __m128 tHit = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, _mm_set1_ps(std::numeric_limits<float>::infinity())));
+
+		__m128 tMin = _mm_min_ps(tHit, _mm_shuffle_ps(tHit, tHit, _MM_SHUFFLE(2, 3, 0, 1)));
+		tMin = _mm_min_ps(tMin, _mm_shuffle_ps(tMin, tMin, _MM_SHUFFLE(1, 0, 3, 2)));
+
+		const int nearest = _mm_movemask_ps(_mm_cmpeq_ps(tHit, tMin)) & mask;
+		for (int i = 0; i < 4; i++) {
+			if (nearest & (1 << i))
+				return i;
+		}
+		return -1;
+	}
+}
+
+template <>
+int MeshQuery::slabTestSoa<4>(const float * minX, const float * minY, const float * minZ, const float * maxX, const float * maxY, const float * maxZ,
+	const glm::vec3 & org, const glm::vec3 & invDir, float tMax, float * tEntry)
+{
+	const __m128 lo[3] = { _mm_loadu_ps(minX), _mm_loadu_ps(minY), _mm_loadu_ps(minZ) };
+	const __m128 hi[3] = { _mm_loadu_ps(maxX), _mm_loadu_ps(maxY), _mm_loadu_ps(maxZ) };
+
+	return slabTest4(lo, hi, org, invDir, tMax, tEntry);
+}
+
+template <>
+int MeshQuery::slabTestSoa<8>(const float * minX, const float * minY, const float * minZ, const float * maxX, const float * maxY, const float * maxZ,
+	const glm::vec3 & org, const glm::vec3 & invDir, float tMax, float * tEntry)
+{
+#if defined(__AVX__)
+	const __m256 ox = _mm256_set1_ps(org.x), oy = _mm256_set1_ps(org.y), oz = _mm256_set1_ps(org.z);
+	const __m256 ix = _mm256_set1_ps(invDir.x), iy = _mm256_set1_ps(invDir.y), iz = _mm256_set1_ps(invDir.z);
+
+	const __m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(minX), ox), ix);
+	const __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(maxX), ox), ix);
+	const __m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(minY), oy), iy);
+	const __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(maxY), oy), iy);
+	const __m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(minZ), oz), iz);
+	const __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(maxZ), oz), iz);
+
+	const __m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+		_mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_setzero_ps()));
+	const __m256 tExit = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_max_ps(tz0, tz1));
+	const __m256 tFar = _mm256_min_ps(_mm256_mul_ps(tExit, _mm256_set1_ps(RayPrecomp::EXIT_SCALE)), _mm256_set1_ps(tMax));
+
+	_mm256_storeu_ps(tEntry, tNear);
+	return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ));
+#else
+	//Without AVX run the SSE kernel on both halves
+	int mask = 0;
+	for (int h = 0; h < 8; h += 4) {
+		const __m128 lo[3] = { _mm_loadu_ps(minX + h), _mm_loadu_ps(minY + h), _mm_loadu_ps(minZ + h) };
+		const __m128 hi[3] = { _mm_loadu_ps(maxX + h), _mm_loadu_ps(maxY + h), _mm_loadu_ps(maxZ + h) };
+		mask |= slabTest4(lo, hi, org, invDir, tMax, tEntry + h) << h;
+	}
+
+	return mask;
+#endif
+}
+
+template <>
+int MeshQuery::TrianglePack<4>::intersect(const Ray & r, int laneMask, float tMax, float & t, float & u, float & v) const
+{
+	__m128 tLanes, uLanes, vLanes;
+	const int mask = mollerTrumbore4(v0x_, 4, r, tMax, tLanes, uLanes, vLanes) & laneMask;
+	if (mask == 0)
+		return -1;
+
+	const int lane = nearestLane4(tLanes, mask);
+	float tOut[4], uOut[4], vOut[4];
+	_mm_storeu_ps(tOut, tLanes);
+	_mm_storeu_ps(uOut, uLanes);
+	_mm_storeu_ps(vOut, vLanes);
+	t = tOut[lane];
+	u = uOut[lane];
+	v = vOut[lane];
+	return lane;
+}
+
+template <>
+int MeshQuery::TrianglePack<8>::intersect(const Ray & r, int laneMask, float tMax, float & t, float & u, float & v) const
+{
+	float tOut[8], uOut[8], vOut[8];
+#if defined(__AVX__)
+	const __m256 dx = _mm256_set1_ps(r.direction_.x), dy = _mm256_set1_ps(r.direction_.y), dz = _mm256_set1_ps(r.direction_.z);
+	const __m256 e1x = _mm256_loadu_ps(e1x_), e1y = _mm256_loadu_ps(e1y_), e1z = _mm256_loadu_ps(e1z_);
+	const __m256 e2x = _mm256_loadu_ps(e2x_), e2y = _mm256_loadu_ps(e2y_), e2z = _mm256_loadu_ps(e2z_);
+
+	const __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+	const __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(e2z, dx));
+	const __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(e2x, dy));
+	const __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+	const __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+	const __m256 tx = _mm256_sub_ps(_mm256_set1_ps(r.origin_.x), _mm256_loadu_ps(v0x_));
+	const __m256 ty = _mm256_sub_ps(_mm256_set1_ps(r.origin_.y), _mm256_loadu_ps(v0y_));
+	const __m256 tz = _mm256_sub_ps(_mm256_set1_ps(r.origin_.z), _mm256_loadu_ps(v0z_));
+	const __m256 uLanes = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), invDet);
+
+	const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(e1y, tz));
+	const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(e1z, tx));
+	const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(e1x, ty));
+	const __m256 vLanes = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+	const __m256 tLanes = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+
+	const __m256 absDet = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), det);
+	__m256 hit = _mm256_cmp_ps(absDet, _mm256_set1_ps(std::numeric_limits<float>::min()), _CMP_GE_OQ);
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(uLanes, _mm256_setzero_ps(), _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(vLanes, _mm256_setzero_ps(), _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(uLanes, vLanes), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(tLanes, _mm256_setzero_ps(), _CMP_GT_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(tLanes, _mm256_set1_ps(tMax), _CMP_LT_OQ));
+	const int mask = _mm256_movemask_ps(hit) & laneMask;
+	if (mask == 0)
+		return -1;
+
+	//Horizontal min over both halves, then within the half
+	const __m256 lanes = _mm256_castsi256_ps(_mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1));
+	const __m256 selected = _mm256_cmp_ps(_mm256_and_ps(lanes, _mm256_castsi256_ps(_mm256_set1_epi32(mask))), _mm256_setzero_ps(), _CMP_NEQ_OQ);
+	const __m256 tHit = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::infinity()), tLanes, selected);
+	__m256 tMin = _mm256_min_ps(tHit, _mm256_permute2f128_ps(tHit, tHit, 1));
+	tMin = _mm256_min_ps(tMin, _mm256_shuffle_ps(tMin, tMin, _MM_SHUFFLE(2, 3, 0, 1)));
+	tMin = _mm256_min_ps(tMin, _mm256_shuffle_ps(tMin, tMin, _MM_SHUFFLE(1, 0, 3, 2)));
+
+	const int nearest = _mm256_movemask_ps(_mm256_cmp_ps(tHit, tMin, _CMP_EQ_OQ)) & mask;
+	int lane = 0;
+	while (!(nearest & (1 << lane)))
+		lane++;
+
+	_mm256_storeu_ps(tOut, tLanes);
+	_mm256_storeu_ps(uOut, uLanes);
+	_mm256_storeu_ps(vOut, vLanes);
+#else
+	//Without AVX run the SSE kernel on both halves and keep the nearer lane
+	__m128 tLanes[2], uLanes[2], vLanes[2];
+	int lane = -1;
+	for (int h = 0; h < 2; h++) {
+		const int mask = mollerTrumbore4(v0x_ + 4 * h, 8, r, tMax, tLanes[h], uLanes[h], vLanes[h]) & (laneMask >> (4 * h));
+		_mm_storeu_ps(tOut + 4 * h, tLanes[h]);
+		_mm_storeu_ps(uOut + 4 * h, uLanes[h]);
+		_mm_storeu_ps(vOut + 4 * h, vLanes[h]);
+
+		if (mask != 0) {
+			const int half = 4 * h + nearestLane4(tLanes[h], mask);
+			if (lane < 0 || tOut[half] < tOut[lane])
+				lane = half;
+		}
+	}
+
+	if (lane < 0)
+		return -1;
+#endif
+
+	t = tOut[lane];
+	u = uOut[lane];
+	v = vOut[lane];
+	return lane;
+}
+
+template <int N>
+int MeshQuery::QuantizedBvhNode<N>::intersect(const glm::vec3 & org, const glm::vec3 & invDir, float tMax, float * tEntry) const
+{
+	int mask = 0;
+	for (int h = 0; h < N; h += 4) {
+		const __m128 lo[3] = { decode4(qMinX_ + h, origin_.x, exponent_[0]), decode4(qMinY_ + h, origin_.y, exponent_[1]), decode4(qMinZ_ + h, origin_.z, exponent_[2]) };
+		const __m128 hi[3] = { decode4(qMaxX_ + h, origin_.x, exponent_[0]), decode4(qMaxY_ + h, origin_.y, exponent_[1]), decode4(qMaxZ_ + h, origin_.z, exponent_[2]) };
+		mask |= slabTest4(lo, hi, org, invDir, tMax, tEntry + h) << h;
+	}
+
+	return mask & ((1 << nChildren_) - 1);
+}
+
+template struct MeshQuery::QuantizedBvhNode<4>;
+template struct MeshQuery::QuantizedBvhNode<8>;
+
+MeshQuery::BvhNode * MeshQuery::BVH::recursiveBuild(std::vector<PrimitiveInfo>& primInfo, int start, int end, std::atomic<int>* totalNodes, std::vector<Triangle>& orderedPrims)
+{
+	if (start == end)
+		return nullptr;
+
+	BvhNode* node = nodes_.allocate();
+	(*totalNodes)++;
+
+	AABB bounds, centroidBounds;
+	computeBounds(&primInfo[start], end - start, settings_.parallelPassCutoff_, &bounds, &centroidBounds);
+
+	//Every range owns the same slots in orderedPrims, so leaves never contend with each other
+	auto makeLeaf = [&]() {
+		for (int i = start; i < end; i++) {
+			orderedPrims[i] = prims_[primInfo[i].primNum_];
+			primIndices_[i] = static_cast<uint32_t>(primInfo[i].primNum_);
+		}
+		node->initLeaf(start, end - start, bounds);
+		return node;
+	};
+
+	int numOfPrims = end - start;
+	if (numOfPrims == 1 || (strategy_ != Sah && static_cast<size_t>(numOfPrims) <= settings_.leafPrims_))
+		return makeLeaf();
+
+	//Largest leaf the strategy may make, both limits are clamped to what LinearBvhNode can hold
+	const size_t maxLeafPrims = strategy_ == Sah ? settings_.maxPrimsInNode_ : settings_.leafPrims_;
+
+	int axis = centroidBounds.getDominantAxis();
+	int mid = (start + end) / 2;
+	//We dont have any volume so we should stop the recursion
+	if (centroidBounds.min_[axis] == centroidBounds.max_[axis]) {
+		//Unless the leaf would be too big, then the coincident centroids are halved by index
+		if (static_cast<size_t>(numOfPrims) <= maxLeafPrims)
+			return makeLeaf();
+		mid = partitionEqualCounts(primInfo, start, end, axis);
+	}
+	else if (strategy_ == Sah) {
+		//No SAH split when the centroids all fall in one bucket, the same fallback applies
+		if (!partitionSah(primInfo, start, end, bounds, centroidBounds, axis, mid)) {
+			if (static_cast<size_t>(numOfPrims) <= maxLeafPrims)
+				return makeLeaf();
+			mid = partitionEqualCounts(primInfo, start, end, axis);
+		}
+	}
+	else {
+		if (strategy_ != EqualCountes) {
+			float midPt = (centroidBounds.min_[axis] + centroidBounds.max_[axis]) / 2;
+
+			mid = start + static_cast<int>(partitionPrimitives(&primInfo[start], end - start, settings_.parallelPassCutoff_,
+				[axis, midPt](const PrimitiveInfo& prim) {
+				return prim.centroid_[axis] < midPt;
+			}));
+		}
+
+		//Midpoint can leave one side empty on clustered centroids, equal counts always halves the range
+		if (strategy_ == EqualCountes || mid == start || mid == end) {
+			mid = partitionEqualCounts(primInfo, start, end, axis);
+		}
+	}
+
+	BvhNode* children[2];
+	if (static_cast<size_t>(numOfPrims) > settings_.parallelBuildCutoff_) {
+		TaskPool& pool = TaskPool::instance();
+		TaskPool::TaskGroup group;
+		pool.run(group, [&]() { children[1] = recursiveBuild(primInfo, mid, end, totalNodes, orderedPrims); });
+		children[0] = recursiveBuild(primInfo, start, mid, totalNodes, orderedPrims);
+		pool.wait(group);
+	}
+	else {
+		children[0] = recursiveBuild(primInfo, start, mid, totalNodes, orderedPrims);
+		children[1] = recursiveBuild(primInfo, mid, end, totalNodes, orderedPrims);
+	}
+
+	node->initInterior(axis, children[0], children[1]);
+	return node;
+}
+
+int MeshQuery::BVH::partitionEqualCounts(std::vector<PrimitiveInfo>& primInfo, int start, int end, int axis) const
+{
+	int mid = (start + end) / 2;
+	std::nth_element(&primInfo[start], &primInfo[mid],
+		&primInfo[end - 1] + 1,
+		[axis](const PrimitiveInfo& a, const PrimitiveInfo& b) {
+		return a.centroid_[axis] < b.centroid_[axis];
+	});
+
+	return mid;
+}
+
+bool MeshQuery::BVH::partitionSah(std::vector<PrimitiveInfo>& primInfo, int start, int end, const AABB& bounds, const AABB& centroidBounds, int& axis, int& mid, float* splitCost) const
+{
+	struct Bucket
+	{
+		int count_ = 0;
+		AABB aabb_;
+	};
+
+	const size_t nBuckets = std::max<size_t>(2, std::min<size_t>(settings_.sahBuckets_, size_t(BvhBuildSettings::MAX_SAH_BUCKETS)));
+	const int numOfPrims = end - start;
+	const float invArea = 1.0f / std::max(bounds.surfaceArea(), std::numeric_limits<float>::min());
+
+	auto bucketOf = [&](const PrimitiveInfo& prim, int dim) {
+		size_t b = static_cast<size_t>(static_cast<float>(nBuckets) * centroidBounds.offset(prim.centroid_)[dim]);
+		return std::min(b, nBuckets - 1);
+	};
+
+	//All three axes are binned in the same pass, large ranges bin chunks in parallel and merge the buckets
+	struct AxisBuckets
+	{
+		Bucket axis_[3][BvhBuildSettings::MAX_SAH_BUCKETS];
+	};
+
+	const size_t nChunks = static_cast<size_t>(numOfPrims) > settings_.parallelPassCutoff_ ? chunkCount(numOfPrims) : 1;
+	const size_t chunkSize = (numOfPrims + nChunks - 1) / nChunks;
+	//The first chunk bins on the stack, so small ranges never allocate
+	AxisBuckets binned;
+	std::vector<AxisBuckets> chunkBuckets(nChunks - 1);
+	auto binChunk = [&](size_t c) {
+		AxisBuckets& buckets = c == 0 ? binned : chunkBuckets[c - 1];
+		for (int i = start + static_cast<int>(c * chunkSize); i < std::min(end, start + static_cast<int>((c + 1) * chunkSize)); i++) {
+			const glm::vec3 offset = centroidBounds.offset(primInfo[i].centroid_);
+			for (int dim = 0; dim < 3; dim++) {
+				Bucket& b = buckets.axis_[dim][std::min(static_cast<size_t>(static_cast<float>(nBuckets) * offset[dim]), nBuckets - 1)];
+				b.count_++;
+				b.aabb_ = Union(b.aabb_, primInfo[i].aabb_);
+			}
+		}
+	};
+
+	if (nChunks > 1)
+		TaskPool::instance().parallelFor(nChunks, binChunk);
+	else
+		binChunk(0);
+
+	for (size_t c = 1; c < nChunks; c++) {
+		for (int dim = 0; dim < 3; dim++) {
+			for (size_t i = 0; i < nBuckets; i++) {
+				Bucket& merged = binned.axis_[dim][i];
+				merged.count_ += chunkBuckets[c - 1].axis_[dim][i].count_;
+				merged.aabb_ = Union(merged.aabb_, chunkBuckets[c - 1].axis_[dim][i].aabb_);
+			}
+		}
+	}
+
+	float bestCost = std::numeric_limits<float>::max();
+	int bestAxis = -1;
+	size_t bestSplit = 0;
+
+	for (int dim = 0; dim < 3; dim++) {
+		if (centroidBounds.max_[dim] <= centroidBounds.min_[dim])
+			continue;
+
+		const Bucket* buckets = binned.axis_[dim];
+
+		//Sweep from the right so the left sweep can evaluate every split plane in one pass
+		float rightArea[BvhBuildSettings::MAX_SAH_BUCKETS];
+		int rightCount[BvhBuildSettings::MAX_SAH_BUCKETS];
+		AABB acc;
+		int count = 0;
+		for (size_t i = nBuckets - 1; i > 0; i--) {
+			acc = Union(acc, buckets[i].aabb_);
+			count += buckets[i].count_;
+			rightArea[i] = acc.surfaceArea();
+			rightCount[i] = count;
+		}
+
+		acc = AABB();
+		count = 0;
+		for (size_t i = 1; i < nBuckets; i++) {
+			acc = Union(acc, buckets[i - 1].aabb_);
+			count += buckets[i - 1].count_;
+			if (count == 0 || rightCount[i] == 0)
+				continue;
+
+			float cost = settings_.traversalCost_ + settings_.intersectionCost_ *
+				(count * acc.surfaceArea() + rightCount[i] * rightArea[i]) * invArea;
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = dim;
+				bestSplit = i;
+			}
+		}
+	}
+
+	if (splitCost != nullptr)
+		*splitCost = bestCost;
+
+	float leafCost = settings_.intersectionCost_ * numOfPrims;
+	if (bestAxis < 0 || (static_cast<size_t>(numOfPrims) <= settings_.maxPrimsInNode_ && leafCost <= bestCost))
+		return false;
+
+	axis = bestAxis;
+	mid = start + static_cast<int>(partitionPrimitives(&primInfo[start], numOfPrims, settings_.parallelPassCutoff_,
+		[&, bestAxis, bestSplit](const PrimitiveInfo& prim) {
+		return bucketOf(prim, bestAxis) < bestSplit;
+	}));
+	return true;
+}
+
+std::vector<MeshQuery::MortonPrimitive> MeshQuery::BVH::computeMortonPrimitives(const std::vector<PrimitiveInfo>& primInfo, int * totalBits) const
+{
+	AABB centroidBounds;
+	for (const auto& prim : primInfo) {
+		centroidBounds = Union(centroidBounds, prim.centroid_);
+	}
+
+	//Quantize on a cube so the Morton cells, and with them the LBVH splits, stay isotropic on elongated meshes
+	const glm::vec3 extent = centroidBounds.max_ - centroidBounds.min_;
+	centroidBounds.max_ = centroidBounds.min_ + glm::vec3(std::max(extent.x, std::max(extent.y, extent.z)));
+
+	const bool wideCodes = settings_.mortonBits_ > 30;
+	const int bitsPerAxis = wideCodes ? 21 : 10;
+	*totalBits = 3 * bitsPerAxis;
+	const float scale = static_cast<float>(1 << bitsPerAxis);
+
+	std::vector<MortonPrimitive> mortonPrims(primInfo.size());
+	const size_t chunkSize = 1024;
+	TaskPool::instance().parallelFor((primInfo.size() + chunkSize - 1) / chunkSize, [&](size_t c) {
+		for (size_t i = c * chunkSize; i < std::min(primInfo.size(), (c + 1) * chunkSize); i++) {
+			glm::vec3 o = glm::clamp(centroidBounds.offset(primInfo[i].centroid_) * scale, glm::vec3(0.0f), glm::vec3(scale - 1.0f));
+			uint32_t x = static_cast<uint32_t>(o.x), y = static_cast<uint32_t>(o.y), z = static_cast<uint32_t>(o.z);
+
+			mortonPrims[i].primIndex_ = i;
+			mortonPrims[i].mortonCode_ = wideCodes ?
+				(leftShift3Wide(z) << 2) | (leftShift3Wide(y) << 1) | leftShift3Wide(x) :
+				(leftShift3(z) << 2) | (leftShift3(y) << 1) | leftShift3(x);
+		}
+	});
+
+	radixSort(&mortonPrims, *totalBits);
+	return mortonPrims;
+}
+
+MeshQuery::BvhNode * MeshQuery::BVH::hlbvhBuild(std::vector<PrimitiveInfo>& primInfo, std::atomic<int>* totalNodes, std::vector<Triangle>& orderedPrims)
+{
+	struct LbvhTreelet
+	{
+		int startIndex_;
+		int nPrims_;
+		BvhNode* root_;
+	};
+
+	if (primInfo.empty())
+		return nullptr;
+
+	int totalBits = 0;
+	std::vector<MortonPrimitive> mortonPrims = computeMortonPrimitives(primInfo, &totalBits);
+
+	//Treelets are the runs of primitives sharing the top 12 code bits, i.e. a 16^3 grid over the centroids
+	const int treeletShift = totalBits - 12;
+	std::vector<LbvhTreelet> treelets;
+	for (int start = 0, end = 1; end <= static_cast<int>(mortonPrims.size()); end++) {
+		if (end == static_cast<int>(mortonPrims.size()) ||
+			(mortonPrims[start].mortonCode_ >> treeletShift) != (mortonPrims[end].mortonCode_ >> treeletShift)) {
+			treelets.push_back({ start, end - start, nullptr });
+			start = end;
+		}
+	}
+
+	std::atomic<int> orderedPrimsOffset(0);
+	TaskPool::instance().parallelFor(treelets.size(), [&](size_t i) {
+		int nodesCreated = 0;
+		LbvhTreelet& tr = treelets[i];
+		tr.root_ = emitLbvh(primInfo, &mortonPrims[tr.startIndex_], tr.nPrims_, &nodesCreated,
+			orderedPrims, &orderedPrimsOffset, treeletShift - 1);
+		*totalNodes += nodesCreated;
+	});
+
+	std::vector<BvhNode*> treeletRoots(treelets.size());
+	std::vector<PrimitiveInfo> rootInfo(treelets.size());
+	for (size_t i = 0; i < treelets.size(); i++) {
+		treeletRoots[i] = treelets[i].root_;
+		rootInfo[i] = { i, treelets[i].root_->aabb_ };
+	}
+
+	return buildUpperSah(rootInfo, 0, static_cast<int>(rootInfo.size()), treeletRoots, totalNodes);
+}
+
+MeshQuery::BvhNode * MeshQuery::BVH::emitLbvh(const std::vector<PrimitiveInfo>& primInfo, const MortonPrimitive * mortonPrims, int nPrims, int * totalNodes,
+	std::vector<Triangle>& orderedPrims, std::atomic<int>* orderedPrimsOffset, int bitIndex)
+{
+	if (nPrims <= std::max(1, static_cast<int>(settings_.maxPrimsInNode_))) {
+		(*totalNodes)++;
+		BvhNode* node = nodes_.allocate();
+		AABB bounds;
+		int offset = orderedPrimsOffset->fetch_add(nPrims);
+		for (int i = 0; i < nPrims; i++) {
+			size_t primIndex = mortonPrims[i].primIndex_;
+			orderedPrims[offset + i] = prims_[primInfo[primIndex].primNum_];
+			primIndices_[offset + i] = static_cast<uint32_t>(primInfo[primIndex].primNum_);
+			bounds = Union(bounds, primInfo[primIndex].aabb_);
+		}
+		node->initLeaf(offset, nPrims, bounds);
+		return node;
+	}
+
+	int splitOffset = nPrims / 2;
+	int axis = 0;
+	if (bitIndex >= 0) {
+		//Identical bit on both ends means every primitive is on the same side of this plane
+		const uint64_t mask = 1ull << bitIndex;
+		if ((mortonPrims[0].mortonCode_ & mask) == (mortonPrims[nPrims - 1].mortonCode_ & mask))
+			return emitLbvh(primInfo, mortonPrims, nPrims, totalNodes, orderedPrims, orderedPrimsOffset, bitIndex - 1);
+
+		int searchStart = 0, searchEnd = nPrims - 1;
+		while (searchStart + 1 != searchEnd) {
+			int mid = (searchStart + searchEnd) / 2;
+			if ((mortonPrims[searchStart].mortonCode_ & mask) == (mortonPrims[mid].mortonCode_ & mask))
+				searchStart = mid;
+			else
+				searchEnd = mid;
+		}
+		splitOffset = searchEnd;
+		axis = bitIndex % 3;
+	}
+
+	(*totalNodes)++;
+	BvhNode* node = nodes_.allocate();
+	BvhNode* c0 = emitLbvh(primInfo, mortonPrims, splitOffset, totalNodes, orderedPrims, orderedPrimsOffset, bitIndex - 1);
+	BvhNode* c1 = emitLbvh(primInfo, &mortonPrims[splitOffset], nPrims - splitOffset, totalNodes, orderedPrims, orderedPrimsOffset, bitIndex - 1);
+	node->initInterior(axis, c0, c1);
+	return node;
+}
+
+MeshQuery::BvhNode * MeshQuery::BVH::buildUpperSah(std::vector<PrimitiveInfo>& rootInfo, int start, int end, const std::vector<BvhNode*>& treeletRoots, std::atomic<int>* totalNodes)
+{
+	if (end - start == 1)
+		return treeletRoots[rootInfo[start].primNum_];
+
+	(*totalNodes)++;
+	BvhNode* node = nodes_.allocate();
+
+	AABB bounds, centroidBounds;
+	for (int i = start; i < end; i++) {
+		bounds = Union(bounds, rootInfo[i].aabb_);
+		centroidBounds = Union(centroidBounds, rootInfo[i].centroid_);
+	}
+
+	//Treelets can not be merged into leaves, so fall back to an even split when SAH prefers one
+	int axis = centroidBounds.getDominantAxis();
+	int mid = (start + end) / 2;
+	if (centroidBounds.min_[axis] == centroidBounds.max_[axis] ||
+		!partitionSah(rootInfo, start, end, bounds, centroidBounds, axis, mid)) {
+		mid = (start + end) / 2;
+	}
+
+	node->initInterior(axis, buildUpperSah(rootInfo, start, mid, treeletRoots, totalNodes),
+		buildUpperSah(rootInfo, mid, end, treeletRoots, totalNodes));
+	return node;
+}
+
+void MeshQuery::BVH::earlySplit(std::vector<PrimitiveInfo>& primInfo) const
+{
+	AABB sceneBounds;
+	for (const auto& prim : primInfo) {
+		sceneBounds = Union(sceneBounds, prim.aabb_);
+	}
+
+	const float maxArea = settings_.earlySplitThreshold_ * sceneBounds.surfaceArea();
+	if (!(maxArea > 0.0f))
+		return;
+
+	std::vector<PrimitiveInfo> refs;
+	refs.reserve(primInfo.size());
+	std::vector<PrimitiveInfo> pending;
+	for (const auto& prim : primInfo) {
+		if (prim.aabb_.surfaceArea() <= maxArea) {
+			refs.push_back(prim);
+			continue;
+		}
+
+		size_t nRefs = 1;
+		pending.push_back(prim);
+		while (!pending.empty()) {
+			PrimitiveInfo ref = pending.back();
+			pending.pop_back();
+			if (ref.aabb_.surfaceArea() <= maxArea || nRefs >= settings_.earlySplitMaxRefs_) {
+				refs.push_back(ref);
+				continue;
+			}
+
+			const Triangle& triangle = prims_[ref.primNum_];
+			int axis = ref.aabb_.getDominantAxis();
+			float position = 0.5f * (ref.aabb_.min_[axis] + ref.aabb_.max_[axis]);
+			AABB left = clipTriangle(triangle, ref.aabb_, axis, ref.aabb_.min_[axis], position);
+			AABB right = clipTriangle(triangle, ref.aabb_, axis, position, ref.aabb_.max_[axis]);
+
+			//Degenerate triangles can clip away completely, keep the reference whole then
+			if (left.isEmpty() || right.isEmpty()) {
+				refs.push_back(ref);
+				continue;
+			}
+
+			nRefs++;
+			pending.push_back({ ref.primNum_, left });
+			pending.push_back({ ref.primNum_, right });
+		}
+	}
+
+	primInfo.swap(refs);
+}
+
+MeshQuery::AABB MeshQuery::BVH::clipTriangle(const Triangle & triangle, const AABB & refBounds, int axis, float lo, float hi)
+{
+	//Bounds of the triangle inside the slab are spanned by the vertices in it and the edge crossings of both planes
+	AABB clipped;
+	for (int i = 0; i < 3; i++) {
+		const glm::vec3& v0 = triangle.vertices_[i];
+		const glm::vec3& v1 = triangle.vertices_[(i + 1) % 3];
+
+		if (v0[axis] >= lo && v0[axis] <= hi)
+			clipped.extendBy(v0);
+
+		for (float plane : { lo, hi }) {
+			if ((v0[axis] < plane && v1[axis] > plane) || (v0[axis] > plane && v1[axis] < plane)) {
+				float t = (plane - v0[axis]) / (v1[axis] - v0[axis]);
+				glm::vec3 p = v0 + t * (v1 - v0);
+				p[axis] = plane;
+				clipped.extendBy(p);
+			}
+		}
+	}
+
+	clipped.min_ = max(clipped.min_, refBounds.min_);
+	clipped.max_ = min(clipped.max_, refBounds.max_);
+	return clipped;
+}
+
+bool MeshQuery::BVH::findSpatialSplit(const std::vector<PrimitiveInfo>& refs, const AABB & bounds, float & cost, int & axis, float & position) const
+{
+	struct Bin
+	{
+		int entries_ = 0;
+		int exits_ = 0;
+		AABB aabb_;
+	};
+
+	const size_t nBins = std::max<size_t>(2, std::min<size_t>(settings_.sahBuckets_, size_t(BvhBuildSettings::MAX_SAH_BUCKETS)));
+	const float invArea = 1.0f / std::max(bounds.surfaceArea(), std::numeric_limits<float>::min());
+	bool found = false;
+
+	for (int dim = 0; dim < 3; dim++) {
+		const float origin = bounds.min_[dim];
+		const float binWidth = (bounds.max_[dim] - origin) / static_cast<float>(nBins);
+		if (!(binWidth > 0.0f))
+			continue;
+
+		auto binOf = [&](float p) {
+			int b = static_cast<int>((p - origin) / binWidth);
+			return std::max(0, std::min(static_cast<int>(nBins) - 1, b));
+		};
+
+		Bin bins[BvhBuildSettings::MAX_SAH_BUCKETS];
+		for (const auto& ref : refs) {
+			const int first = binOf(ref.aabb_.min_[dim]);
+			const int last = binOf(ref.aabb_.max_[dim]);
+			bins[first].entries_++;
+			bins[last].exits_++;
+
+			if (first == last) {
+				bins[first].aabb_ = Union(bins[first].aabb_, ref.aabb_);
+				continue;
+			}
+
+			const Triangle& triangle = prims_[ref.primNum_];
+			for (int b = first; b <= last; b++) {
+				const float lo = origin + b * binWidth;
+				const float hi = b + 1 == static_cast<int>(nBins) ? bounds.max_[dim] : lo + binWidth;
+				AABB clipped = clipTriangle(triangle, ref.aabb_, dim, lo, hi);
+				if (!clipped.isEmpty())
+					bins[b].aabb_ = Union(bins[b].aabb_, clipped);
+			}
+		}
+
+		float rightArea[BvhBuildSettings::MAX_SAH_BUCKETS];
+		int rightCount[BvhBuildSettings::MAX_SAH_BUCKETS];
+		AABB acc;
+		int count = 0;
+		for (size_t i = nBins - 1; i > 0; i--) {
+			acc = Union(acc, bins[i].aabb_);
+			count += bins[i].exits_;
+			rightArea[i] = acc.surfaceArea();
+			rightCount[i] = count;
+		}
+
+		acc = AABB();
+		count = 0;
+		for (size_t i = 1; i < nBins; i++) {
+			acc = Union(acc, bins[i - 1].aabb_);
+			count += bins[i - 1].entries_;
+			if (count == 0 || rightCount[i] == 0)
+				continue;
+
+			float splitCost = settings_.traversalCost_ + settings_.intersectionCost_ *
+				(count * acc.surfaceArea() + rightCount[i] * rightArea[i]) * invArea;
+			if (splitCost < cost) {
+				cost = splitCost;
+				axis = dim;
+				position = origin + static_cast<float>(i) * binWidth;
+				found = true;
+			}
+		}
+	}
+
+	return found;
+}
+
+MeshQuery::BvhNode * MeshQuery::BVH::recursiveBuildSbvh(std::vector<PrimitiveInfo>& refs, float rootArea, std::atomic<int>* totalNodes, std::vector<Triangle>& orderedPrims, int64_t* refsLeft)
+{
+	BvhNode* node = nodes_.allocate();
+	(*totalNodes)++;
+
+	AABB bounds, centroidBounds;
+	computeBounds(refs.data(), refs.size(), settings_.parallelPassCutoff_, &bounds, &centroidBounds);
+
+	const int numOfPrims = static_cast<int>(refs.size());
+	auto makeLeaf = [&]() {
+		int offset = static_cast<int>(orderedPrims.size());
+		for (const auto& ref : refs) {
+			orderedPrims.push_back(prims_[ref.primNum_]);
+			primIndices_.push_back(static_cast<uint32_t>(ref.primNum_));
+		}
+		node->initLeaf(offset, numOfPrims, bounds);
+		return node;
+	};
+
+	if (numOfPrims == 1)
+		return makeLeaf();
+
+	//Object split first, refs are partitioned in place and left alone if a spatial split wins
+	int axis = centroidBounds.getDominantAxis();
+	int mid = numOfPrims / 2;
+	float objectCost = std::numeric_limits<float>::max();
+	bool objectSplit = false;
+	if (centroidBounds.max_[axis] > centroidBounds.min_[axis])
+		objectSplit = partitionSah(refs, 0, numOfPrims, bounds, centroidBounds, axis, mid, &objectCost);
+
+	//Spatial splits only pay off where the object split children overlap noticeably
+	float overlapArea = 0.0f;
+	if (objectSplit) {
+		AABB left, right;
+		for (int i = 0; i < mid; i++) left = Union(left, refs[i].aabb_);
+		for (int i = mid; i < numOfPrims; i++) right = Union(right, refs[i].aabb_);
+		AABB overlap(max(left.min_, right.min_), min(left.max_, right.max_));
+		overlapArea = overlap.surfaceArea();
+	}
+
+	float spatialCost = objectCost;
+	int spatialAxis = 0;
+	float position = 0.0f;
+	bool spatialSplit = *refsLeft > 0 && (!objectSplit || overlapArea > settings_.sbvhMinOverlap_ * rootArea) &&
+		findSpatialSplit(refs, bounds, spatialCost, spatialAxis, position);
+
+	const float leafCost = settings_.intersectionCost_ * numOfPrims;
+	if (spatialSplit && static_cast<size_t>(numOfPrims) <= settings_.maxPrimsInNode_ && leafCost <= spatialCost)
+		spatialSplit = false;
+
+	std::vector<PrimitiveInfo> leftRefs, rightRefs;
+	if (spatialSplit) {
+		AABB leftBounds, rightBounds;
+		std::vector<PrimitiveInfo> straddling;
+		for (const auto& ref : refs) {
+			if (ref.aabb_.max_[spatialAxis] <= position) {
+				leftRefs.push_back(ref);
+				leftBounds = Union(leftBounds, ref.aabb_);
+			}
+			else if (ref.aabb_.min_[spatialAxis] >= position) {
+				rightRefs.push_back(ref);
+				rightBounds = Union(rightBounds, ref.aabb_);
+			}
+			else {
+				straddling.push_back(ref);
+			}
+		}
+
+		//Straddling references are split unless moving them whole to one side is cheaper
+		int64_t duplicated = 0;
+		for (const auto& ref : straddling) {
+			const Triangle& triangle = prims_[ref.primNum_];
+			const float lo = std::numeric_limits<float>::lowest(), hi = std::numeric_limits<float>::max();
+			PrimitiveInfo leftPart(ref.primNum_, clipTriangle(triangle, ref.aabb_, spatialAxis, lo, position));
+			PrimitiveInfo rightPart(ref.primNum_, clipTriangle(triangle, ref.aabb_, spatialAxis, position, hi));
+
+			const float nl = static_cast<float>(leftRefs.size()), nr = static_cast<float>(rightRefs.size());
+			const float splitCost = Union(leftBounds, leftPart.aabb_).surfaceArea() * (nl + 1) + Union(rightBounds, rightPart.aabb_).surfaceArea() * (nr + 1);
+			const float leftCost = Union(leftBounds, ref.aabb_).surfaceArea() * (nl + 1) + rightBounds.surfaceArea() * nr;
+			const float rightCost = leftBounds.surfaceArea() * nl + Union(rightBounds, ref.aabb_).surfaceArea() * (nr + 1);
+
+			if (*refsLeft > 0 && splitCost < leftCost && splitCost < rightCost && !leftPart.aabb_.isEmpty() && !rightPart.aabb_.isEmpty()) {
+				(*refsLeft)--;
+				duplicated++;
+				leftRefs.push_back(leftPart);
+				rightRefs.push_back(rightPart);
+				leftBounds = Union(leftBounds, leftPart.aabb_);
+				rightBounds = Union(rightBounds, rightPart.aabb_);
+			}
+			else if (leftCost <= rightCost) {
+				leftRefs.push_back(ref);
+				leftBounds = Union(leftBounds, ref.aabb_);
+			}
+			else {
+				rightRefs.push_back(ref);
+				rightBounds = Union(rightBounds, ref.aabb_);
+			}
+		}
+		axis = spatialAxis;
+		spatialSplit = !leftRefs.empty() && !rightRefs.empty();
+		if (!spatialSplit)
+			*refsLeft += duplicated;
+	}
+
+	if (!spatialSplit) {
+		if (!objectSplit) {
+			if (static_cast<size_t>(numOfPrims) <= std::min(settings_.maxPrimsInNode_, size_t(LinearBvhNode::MAX_PRIMS)) && leafCost <= objectCost)
+				return makeLeaf();
+
+			//Nothing separates the references, halve them so the recursion still terminates
+			axis = bounds.getDominantAxis();
+			mid = partitionEqualCounts(refs, 0, numOfPrims, axis);
+		}
+
+		leftRefs.assign(refs.begin(), refs.begin() + mid);
+		rightRefs.assign(refs.begin() + mid, refs.end());
+	}
+
+	std::vector<PrimitiveInfo>().swap(refs);
+	BvhNode* c0 = recursiveBuildSbvh(leftRefs, rootArea, totalNodes, orderedPrims, refsLeft);
+	BvhNode* c1 = recursiveBuildSbvh(rightRefs, rootArea, totalNodes, orderedPrims, refsLeft);
+	node->initInterior(axis, c0, c1);
+	return node;
+}
+
+int MeshQuery::BVH::separatingAxis(const AABB & a, const AABB & b)
+{
+	glm::vec3 d = glm::abs((b.min_ + b.max_) - (a.min_ + a.max_));
+	return d.x > d.y && d.x > d.z ? 0 : (d.y > d.z ? 1 : 2);
+}
+
+MeshQuery::BvhNode * MeshQuery::BVH::plocBuild(std::vector<PrimitiveInfo>& primInfo, std::atomic<int>* totalNodes, std::vector<Triangle>& orderedPrims)
+{
+	if (primInfo.empty())
+		return nullptr;
+
+	int totalBits = 0;
+	std::vector<MortonPrimitive> mortonPrims = computeMortonPrimitives(primInfo, &totalBits);
+
+	//Every primitive starts as a single primitive leaf cluster, in Morton order
+	const size_t chunkSize = 1024;
+	std::vector<BvhNode*> clusters(mortonPrims.size());
+	TaskPool::instance().parallelFor((clusters.size() + chunkSize - 1) / chunkSize, [&](size_t c) {
+		for (size_t i = c * chunkSize; i < std::min(clusters.size(), (c + 1) * chunkSize); i++) {
+			const PrimitiveInfo& prim = primInfo[mortonPrims[i].primIndex_];
+			orderedPrims[i] = prims_[prim.primNum_];
+			primIndices_[i] = static_cast<uint32_t>(prim.primNum_);
+			clusters[i] = nodes_.allocate();
+			clusters[i]->initLeaf(static_cast<int>(i), 1, prim.aabb_);
+		}
+	});
+	*totalNodes += static_cast<int>(clusters.size());
+
+	const int radius = static_cast<int>(std::max<size_t>(1, settings_.plocRadius_));
+	std::vector<int> nearest(clusters.size());
+	std::vector<BvhNode*> merged(clusters.size());
+	std::vector<size_t> chunkOffsets;
+
+	while (clusters.size() > 1) {
+		const int n = static_cast<int>(clusters.size());
+		const size_t nChunks = (clusters.size() + chunkSize - 1) / chunkSize;
+
+		//Nearest neighbour within the radius by merged surface area, ties go to the lower index so pairs are mutual
+		TaskPool::instance().parallelFor(nChunks, [&](size_t c) {
+			for (int i = static_cast<int>(c * chunkSize); i < std::min(n, static_cast<int>((c + 1) * chunkSize)); i++) {
+				float bestArea = std::numeric_limits<float>::max();
+				int best = -1;
+				for (int j = std::max(0, i - radius); j <= std::min(n - 1, i + radius); j++) {
+					if (j == i)
+						continue;
+
+					float area = Union(clusters[i]->aabb_, clusters[j]->aabb_).surfaceArea();
+					if (area < bestArea) {
+						bestArea = area;
+						best = j;
+					}
+				}
+				nearest[i] = best;
+			}
+		});
+
+		//Mutual nearest neighbours merge into the slot of the lower index, the other slot is dropped
+		std::vector<size_t> kept(nChunks);
+		TaskPool::instance().parallelFor(nChunks, [&](size_t c) {
+			int created = 0;
+			for (int i = static_cast<int>(c * chunkSize); i < std::min(n, static_cast<int>((c + 1) * chunkSize)); i++) {
+				const int j = nearest[i];
+				if (nearest[j] == i && j < i) {
+					merged[i] = nullptr;
+					continue;
+				}
+
+				if (nearest[j] == i) {
+					BvhNode* node = nodes_.allocate();
+					node->initInterior(separatingAxis(clusters[i]->aabb_, clusters[j]->aabb_), clusters[i], clusters[j]);
+					merged[i] = node;
+					created++;
+				}
+				else {
+					merged[i] = clusters[i];
+				}
+				kept[c]++;
+			}
+			*totalNodes += created;
+		});
+
+		//Compact the surviving clusters, each chunk scatters to its prefix offset
+		chunkOffsets.assign(nChunks + 1, 0);
+		for (size_t c = 0; c < nChunks; c++) {
+			chunkOffsets[c + 1] = chunkOffsets[c] + kept[c];
+		}
+
+		std::vector<BvhNode*> next(chunkOffsets[nChunks]);
+		TaskPool::instance().parallelFor(nChunks, [&](size_t c) {
+			size_t out = chunkOffsets[c];
+			for (int i = static_cast<int>(c * chunkSize); i < std::min(n, static_cast<int>((c + 1) * chunkSize)); i++) {
+				if (merged[i] != nullptr)
+					next[out++] = merged[i];
+			}
+		});
+
+		clusters.swap(next);
+	}
+
+	return clusters[0];
 }
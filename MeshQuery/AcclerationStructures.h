@@ -2,6 +2,11 @@
 #include <vector>
 #include <memory>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <cstdint>
+#include <unordered_map>
 
 #include "Utility.h"
 
@@ -22,13 +27,55 @@ namespace MeshQuery
 		std::vector<Triangle> objectList_;
 	};
 
+	//Closest hit found along a ray
+	struct Hit
+	{
+		uint32_t primId_;		//index into the triangles the structure was built from
+		float t_;
+		float u_, v_;			//barycentric weights of vertices_[1] and vertices_[2]
+	};
+
+	//Per ray terms of the watertight triangle test: the axes permuted so that z is the largest direction
+	//component, and the shear that maps the direction onto +z
+	struct WatertightRay
+	{
+		explicit WatertightRay(const Ray& r);
+
+		glm::vec3 origin_;
+		int kx_, ky_, kz_;
+		float sx_, sy_, sz_;
+	};
+
 	class AccelerationStructure
 	{
 	public:
 		
 		bool intersect(const Ray& r, const AABB& aabb) const;
+
+		//Slab test without divisions or branches, the near and far plane of each axis are picked by the
+		//direction signs. Returns whether the box overlaps [tMin_, tMax_] and writes the entry distance.
+		static bool intersect(const RayPrecomp& r, const AABB& aabb, float& tEntry)
+		{
+			const float tx0 = ((r.dirIsNeg_[0] ? aabb.max_.x : aabb.min_.x) - r.origin_.x) * r.invDir_.x;
+			const float tx1 = ((r.dirIsNeg_[0] ? aabb.min_.x : aabb.max_.x) - r.origin_.x) * r.invDir_.x;
+			const float ty0 = ((r.dirIsNeg_[1] ? aabb.max_.y : aabb.min_.y) - r.origin_.y) * r.invDir_.y;
+			const float ty1 = ((r.dirIsNeg_[1] ? aabb.min_.y : aabb.max_.y) - r.origin_.y) * r.invDir_.y;
+			const float tz0 = ((r.dirIsNeg_[2] ? aabb.max_.z : aabb.min_.z) - r.origin_.z) * r.invDir_.z;
+			const float tz1 = ((r.dirIsNeg_[2] ? aabb.min_.z : aabb.max_.z) - r.origin_.z) * r.invDir_.z;
+
+			tEntry = std::max(std::max(tx0, ty0), std::max(tz0, r.tMin_));
+			const float tExit = std::min(std::min(tx1, ty1) * RayPrecomp::EXIT_SCALE, std::min(tz1 * RayPrecomp::EXIT_SCALE, r.tMax_));
+			return tEntry <= tExit;
+		}
 		
 		bool intersect(const Ray& r, const Triangle& triangle, float& t) const;
+
+		//Moller-Trumbore, also returns the barycentrics of the hit. t is not range checked.
+		bool intersect(const Ray& r, const Triangle& triangle, float& t, float& u, float& v) const;
+
+		//Watertight test of Woop et al., rays never slip through the edge shared by two triangles. Edge functions
+		//that come out exactly zero in float are recomputed in double. t is not range checked.
+		bool intersect(const WatertightRay& r, const Triangle& triangle, float& t, float& u, float& v) const;
 		
 		inline bool intersect(const AABB &a, const AABB &b) const
 		{
@@ -55,6 +102,9 @@ namespace MeshQuery
 
 		void insertTriangle(OctreeNode* node, Triangle t);
 
+		//Whether any triangle below node is hit between the ray origin and tMax, stops at the first one found
+		bool occluded(const OctreeNode* node, const Ray& r, float tMax) const;
+
 		AABB GetOctaSplit(const AABB& B, size_t Idx)
 		{
 #define x0 B.min_.x
@@ -89,6 +139,9 @@ namespace MeshQuery
 #undef yc
 #undef zc
 		}
+
+	private:
+		bool occluded(const OctreeNode* node, const Ray& r, const RayPrecomp& precomp) const;
 	};
 
 
@@ -97,7 +150,9 @@ namespace MeshQuery
 		Sah,
 		Hlbvh,
 		Middle,
-		EqualCountes
+		EqualCountes,
+		Sbvh,
+		Ploc
 	};
 
 	struct PrimitiveInfo
@@ -112,23 +167,98 @@ namespace MeshQuery
 		glm::vec3 centroid_;
 	};
 
-	inline glm::vec3 min(glm::vec3& a, glm::vec3& b) {
+	struct BvhBuildSettings
+	{
+		static const size_t MAX_SAH_BUCKETS = 64;
+
+		//Number of centroid bins evaluated per axis by the Sah strategy
+		size_t sahBuckets_ = 12;
+		//Relative cost of visiting an interior node vs. intersecting one primitive
+		float traversalCost_ = 0.125f;
+		float intersectionCost_ = 1.0f;
+		//Sah only makes leaves this small or smaller, bigger ranges are always split
+		size_t maxPrimsInNode_ = 8;
+		//Middle and EqualCountes stop splitting at this many primitives
+		size_t leafPrims_ = 1;
+		//BVH clamps both leaf sizes to [1, LinearBvhNode::MAX_PRIMS], the range of the 16 bit leaf counts
+		//Hlbvh quantizes centroids to 30 (10 bits per axis) or 63 (21 bits per axis) bit Morton codes
+		size_t mortonBits_ = 30;
+		//Ranges with more primitives than this build their two subtrees as parallel tasks
+		size_t parallelBuildCutoff_ = 4096;
+		//Ranges with more primitives than this compute bounds, SAH bins and partitions in parallel chunks,
+		//which is where the top levels spend their time before there are enough subtrees to run in parallel
+		size_t parallelPassCutoff_ = 65536;
+		//Branching factor of the traversal layout, 4 or 8 collapses the binary tree into WideBvhNode
+		size_t width_ = 2;
+		//Ploc looks for the nearest cluster among this many neighbours on each side in Morton order
+		size_t plocRadius_ = 16;
+		//Sbvh may add at most this fraction of the primitive count as extra split references
+		float sbvhDuplicationBudget_ = 0.3f;
+		//Sbvh only tries spatial splits where object split children overlap by this fraction of the root area
+		float sbvhMinOverlap_ = 1e-5f;
+		//Treelet restructuring passes run after the build, 0 keeps the builder's topology
+		size_t treeletPasses_ = 0;
+		//Leaves per restructured treelet, the DP over their subsets is O(3^n) so this stays small
+		size_t treeletLeaves_ = 7;
+		//Replaces the wide layout by QuantizedBvhNode, only applies when width_ is 4 or 8
+		bool quantize_ = false;
+		//Triangles whose box has more than this fraction of the scene surface area are split into
+		//several tighter references before the build, 0 disables the pre-pass
+		float earlySplitThreshold_ = 0.0f;
+		//Upper bound on the references a single triangle is split into
+		size_t earlySplitMaxRefs_ = 16;
+		//Leaf triangles are tested this many at a time from SoA packs, 4 (SSE) or 8 (AVX), 0 tests them one by one
+		//8 runs as two SSE halves unless the build targets AVX, as the x64 configurations do
+		size_t trianglePackWidth_ = 4;
+		//Watertight ray/triangle test in intersect() and occluded() instead of Moller-Trumbore, slower but no rays
+		//are lost on shared edges. Leaves are then tested one triangle at a time and no packs are built.
+		bool watertight_ = false;
+	};
+
+	//Tree statistics used to compare strategies per asset, see BVH::getQualityReport()
+	struct BvhQualityReport
+	{
+		//SAH cost of the whole tree relative to a ray hitting the root, with the build settings' costs
+		float sahCost_ = 0.0f;
+		//Summed volume shared by the two children of every interior node
+		float siblingOverlap_ = 0.0f;
+		size_t maxDepth_ = 0;
+		float averageLeafDepth_ = 0.0f;
+		//Leaves per depth, the root is depth 0
+		std::vector<size_t> depthHistogram_;
+		//Leaves per primitive count
+		std::vector<size_t> leafSizeHistogram_;
+		size_t nodeCount_ = 0;
+		size_t leafCount_ = 0;
+		//Build tree nodes held by the arena, traversal layouts and primitive storage
+		size_t treeBytes_ = 0;
+		size_t layoutBytes_ = 0;
+		size_t primitiveBytes_ = 0;
+	};
+
+	struct MortonPrimitive
+	{
+		size_t primIndex_;
+		uint64_t mortonCode_;
+	};
+
+	inline glm::vec3 min(const glm::vec3& a, const glm::vec3& b) {
 		return glm::vec3(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
 	}
 
-	inline glm::vec3 max(glm::vec3& a, glm::vec3& b) {
+	inline glm::vec3 max(const glm::vec3& a, const glm::vec3& b) {
 		return glm::vec3(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
 	}
 
-	inline glm::vec3 min(glm::vec3& a, glm::vec4& b) {
+	inline glm::vec3 min(const glm::vec3& a, const glm::vec4& b) {
 		return glm::vec3(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
 	}
 
-	inline glm::vec3 max(glm::vec3& a, glm::vec4& b) {
+	inline glm::vec3 max(const glm::vec3& a, const glm::vec4& b) {
 		return glm::vec3(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
 	}
 
-	inline AABB Union(AABB& a, AABB& b)
+	inline AABB Union(const AABB& a, const AABB& b)
 	{
 		AABB c;
 		c.min_ = min(a.min_, b.min_);
@@ -136,7 +266,7 @@ namespace MeshQuery
 		return c;
 	}
 
-	inline AABB Union(AABB& a, glm::vec3& b)
+	inline AABB Union(const AABB& a, const glm::vec3& b)
 	{
 		AABB c;
 		c.min_ = min(a.min_, b);
@@ -144,7 +274,7 @@ namespace MeshQuery
 		return c;
 	}
 
-	inline AABB Union(AABB& a, glm::vec4& b)
+	inline AABB Union(const AABB& a, const glm::vec4& b)
 	{
 		AABB c;
 		c.min_ = min(a.min_, b);
@@ -166,6 +296,7 @@ namespace MeshQuery
 		void initInterior(int axis, BvhNode* c0, BvhNode* c1){
 			children_[0] = c0;
 			children_[1] = c1;
+			c0->parent_ = c1->parent_ = this;
 			aabb_ = Union(c0->aabb_, c1->aabb_);
 			splitAxis_ = axis;
 			nPrims_ = 0;
@@ -173,23 +304,564 @@ namespace MeshQuery
 
 		AABB aabb_;
 		BvhNode* children_[2];
+		BvhNode* parent_;	//nullptr for the root
 		size_t splitAxis_;
 		size_t firstPrimOffset_;
 		size_t nPrims_;
+		float sahCost_;		//subtree SAH cost, only maintained while optimizing treelets
+	};
+
+	//Bump allocator owning every BvhNode of a tree, nodes are only released all at once.
+	//Allocation is lock free inside the presized block, overflow blocks are added under a mutex.
+	class BvhNodeArena
+	{
+	public:
+		BvhNodeArena() = default;
+		BvhNodeArena(const BvhNodeArena&) = delete;
+		BvhNodeArena& operator=(const BvhNodeArena&) = delete;
+
+		//Drops all nodes and presizes a single block for capacity nodes
+		void reset(size_t capacity);
+
+		//Value initialized node, safe to call from several build tasks at once
+		BvhNode* allocate();
+
+		size_t size() const { return std::min(used_.load(), capacity_) + overflowSize_; }
+
+		//Memory held, including presized nodes that were never handed out
+		size_t bytes() const { return (capacity_ + overflowBlocks_.size() * overflowBlockSize_) * sizeof(BvhNode); }
+
+	private:
+		static const size_t MIN_OVERFLOW_BLOCK = 1024;
+
+		std::unique_ptr<BvhNode[]> nodes_;
+		size_t capacity_ = 0;
+		std::atomic<size_t> used_{ 0 };
+		std::vector<std::unique_ptr<BvhNode[]>> overflowBlocks_;
+		size_t overflowBlockSize_ = 0;
+		size_t overflowUsed_ = 0;
+		size_t overflowSize_ = 0;
+		std::mutex overflowMutex_;
 	};
 
+	//Node stack of the traversal loops. The first InlineSize entries live in the object itself, deeper trees,
+	//e.g. Middle splits over clustered primitives, spill to the heap instead of overflowing a fixed array.
+	template <typename T, size_t InlineSize>
+	class TraversalStack
+	{
+	public:
+		bool empty() const { return size_ == 0; }
+
+		void push(T value)
+		{
+			if (size_ < InlineSize)
+				inline_[size_] = value;
+			else
+				spill_.push_back(value);
+			size_++;
+		}
+
+		T pop()
+		{
+			size_--;
+			if (size_ < InlineSize)
+				return inline_[size_];
+
+			T value = spill_.back();
+			spill_.pop_back();
+			return value;
+		}
+
+	private:
+		T inline_[InlineSize];
+		std::vector<T> spill_;
+		size_t size_ = 0;
+	};
+
+	//Depth first layout of the built tree, the first child of an interior node is the node right after it
+	struct alignas(32) LinearBvhNode
+	{
+		static const size_t MAX_PRIMS = 0xffff;
+
+		AABB aabb_;
+		union
+		{
+			uint32_t primitivesOffset_;		//leaf
+			uint32_t secondChildOffset_;	//interior
+		};
+		uint16_t nPrims_;					//0 for interior nodes
+		uint8_t axis_;
+		uint8_t pad_;
+	};
+
+	static_assert(sizeof(LinearBvhNode) == 32, "LinearBvhNode should stay 32 bytes, two nodes per cache line");
+
+	//SSE (N == 4) or AVX (N == 8) slab test of N boxes stored SoA, returns the hit mask of all N lanes and writes
+	//their entry distances. Shared by the node layouts that keep their child bounds this way.
+	template <int N>
+	int slabTestSoa(const float* minX, const float* minY, const float* minZ, const float* maxX, const float* maxY, const float* maxZ,
+		const glm::vec3& org, const glm::vec3& invDir, float tMax, float* tEntry);
+
+	template <> int slabTestSoa<4>(const float* minX, const float* minY, const float* minZ, const float* maxX, const float* maxY, const float* maxZ,
+		const glm::vec3& org, const glm::vec3& invDir, float tMax, float* tEntry);
+	template <> int slabTestSoa<8>(const float* minX, const float* minY, const float* minZ, const float* maxX, const float* maxY, const float* maxZ,
+		const glm::vec3& org, const glm::vec3& invDir, float tMax, float* tEntry);
+
+	//N children per node with their bounds stored SoA, so one SSE/AVX slab test covers all of them.
+	//Leaf children are stored inline as a primitive range, interior children as an index into the wide node array.
+	template <int N>
+	struct alignas(32) WideBvhNode
+	{
+		static const int WIDTH = N;
+		typedef uint32_t Index;
+
+		//Slab test of all children, returns the hit mask and writes the entry distance of every child
+		int intersect(const glm::vec3& org, const glm::vec3& invDir, float tMax, float* tEntry) const
+		{
+			return slabTestSoa<N>(minX_, minY_, minZ_, maxX_, maxY_, maxZ_, org, invDir, tMax, tEntry) & ((1 << nChildren_) - 1);
+		}
+
+		bool isLeaf(int i) const { return nPrims_[i] > 0; }
+
+		float minX_[N], minY_[N], minZ_[N];
+		float maxX_[N], maxY_[N], maxZ_[N];
+		uint32_t child_[N];					//primitive offset for leaves, wide node index otherwise
+		uint16_t nPrims_[N];				//0 for interior children
+		uint8_t nChildren_;
+	};
+
+
+	static_assert(sizeof(WideBvhNode<4>) == 128, "BVH4 node should be two cache lines");
+	static_assert(sizeof(WideBvhNode<8>) == 256, "BVH8 node should be four cache lines");
+
+	//WideBvhNode with child bounds stored as 8 bit planes on a per axis power of two grid anchored at origin_.
+	//Planes are rounded outwards, so decoded boxes always contain the real child bounds.
+	template <int N>
+	struct QuantizedBvhNode
+	{
+		static const int WIDTH = N;
+		typedef uint32_t Index;
+
+		//Decodes the child bounds on the fly and slab-tests them like WideBvhNode::intersect
+		int intersect(const glm::vec3& org, const glm::vec3& invDir, float tMax, float* tEntry) const;
+
+		bool isLeaf(int i) const { return nPrims_[i] > 0; }
+
+		glm::vec3 origin_;
+		int8_t exponent_[3];
+		uint8_t nChildren_;
+		uint8_t qMinX_[N], qMinY_[N], qMinZ_[N];
+		uint8_t qMaxX_[N], qMaxY_[N], qMaxZ_[N];
+		uint32_t child_[N];
+		uint16_t nPrims_[N];
+	};
+
+	static_assert(sizeof(QuantizedBvhNode<4>) == 64, "Quantized BVH4 node should be one cache line");
+	static_assert(sizeof(QuantizedBvhNode<8>) == 112, "Quantized BVH8 node should be 14 bytes per child");
+
+	//Triangles in groups of N with vertex 0 and both edges stored SoA, for the N wide Moller-Trumbore kernel.
+	//Pack i holds BVH::getPrimitives()[i * N, i * N + N), lanes past the last triangle are zero and never hit.
+	template <int N>
+	struct alignas(32) TrianglePack
+	{
+		static const int WIDTH = N;
+
+		//Tests the lanes set in laneMask, returns the lane of the nearest hit in (0, tMax) and writes its t and
+		//barycentrics, or returns -1
+		int intersect(const Ray& r, int laneMask, float tMax, float& t, float& u, float& v) const;
+
+		float v0x_[N], v0y_[N], v0z_[N];
+		float e1x_[N], e1y_[N], e1z_[N];
+		float e2x_[N], e2y_[N], e2z_[N];
+	};
+
+	template <> int TrianglePack<4>::intersect(const Ray& r, int laneMask, float tMax, float& t, float& u, float& v) const;
+	template <> int TrianglePack<8>::intersect(const Ray& r, int laneMask, float tMax, float& t, float& u, float& v) const;
+
 	class BVH : public AccelerationStructure
 	{
 	public:
 		BVH() = delete;
-		BVH(const std::vector<Triangle>& prims, BvhStrategy strategy);
-		BvhNode* recursiveBuild(std::vector<PrimitiveInfo>& primInfo, int start, int end, int* totalNodes, std::vector<Triangle>& orderedPrims);
+		BVH(const std::vector<Triangle>& prims, BvhStrategy strategy, const BvhBuildSettings& settings = BvhBuildSettings());
+		BVH(const BVH&) = delete;
+		BVH& operator=(const BVH&) = delete;
+		using AccelerationStructure::intersect;
+		BvhNode* recursiveBuild(std::vector<PrimitiveInfo>& primInfo, int start, int end, std::atomic<int>* totalNodes, std::vector<Triangle>& orderedPrims);
 		BvhNode* root_;
+		std::vector<LinearBvhNode> linearNodes_;
+		std::vector<WideBvhNode<4>> wideNodes4_;
+		std::vector<WideBvhNode<8>> wideNodes8_;
+		std::vector<QuantizedBvhNode<4>> quantizedNodes4_;
+		std::vector<QuantizedBvhNode<8>> quantizedNodes8_;
+
+		//Primitives in leaf order, leaf offsets index into this
+		const std::vector<Triangle>& getPrimitives() const { return prims_; }
+
+		//Index into the triangles the BVH was built from for every entry of getPrimitives()
+		const std::vector<uint32_t>& getPrimitiveIndices() const { return primIndices_; }
+
+		//Recomputes all node bounds bottom up from prims, the same triangles in the same order as at
+		//construction but with moved vertices and aabb_. Topology is kept, so quality degrades with large motion.
+		//Early split references are refitted to the box of their whole triangle.
+		//Triangles added by insert() are expected at the index insert() returned.
+		void refit(const std::vector<Triangle>& prims);
+
+		//Adds triangle as a new leaf, paired with the sibling whose enlargement costs the least SAH, found by
+		//branch and bound from the root. Ancestors are refitted and rotated on the way back up.
+		//Returns the index of the triangle in getPrimitiveIndices() and for remove().
+		uint32_t insert(const Triangle& triangle);
+
+		//Removes every reference of the triangle, empty leaves are dropped and their sibling takes the parent's place.
+		//Returns false if no triangle with that index is in the tree.
+		bool remove(uint32_t primId);
+
+		//insert() and remove() only edit the build tree, this compacts the primitives and rebuilds the traversal
+		//layouts once per batch of edits
+		void updateLayouts();
+
+		bool isLayoutStale() const { return layoutStale_; }
+
+		//Walks the build tree, so the report is current even while the layouts are stale
+		BvhQualityReport getQualityReport() const;
+
+		//One restructuring pass over the built tree: every node roots a treelet whose topology is replaced by
+		//the SAH optimal one, found by dynamic programming over subsets of its leaves. Runs bottom up, in
+		//parallel over the disjoint treelets of each tree level, then rebuilds the traversal layouts.
+		void optimizeTreelets();
+
+		//Closest hit in front of the ray origin, tMax shrinks with every hit so farther subtrees are culled.
+		//Returns false and leaves hit untouched on a miss.
+		bool intersect(const Ray& r, Hit& hit) const;
+
+		//Any hit query for shadow and visibility rays, returns at the first triangle hit before tMax.
+		//Children are not ordered and no hit record is kept. Walks linearNodes_, which should be current.
+		bool occluded(const Ray& r, float tMax) const;
+
+		//Visits the leaves of a wide or quantized layout hit by r, nearest child first. nodes is any array of them
+		//with operator[] and empty(), e.g. one of the vectors above or a MappedBvh section.
+		//leafFunc(primOffset, nPrims, tMax) may shrink tMax and returns true to stop the traversal.
+		template <typename Nodes, typename LeafFunc>
+		static void traverseWide(const Nodes& nodes, const Ray& r, float tMax, LeafFunc&& leafFunc);
+
+		//Same contract as traverseWide over a LinearBvhNode array, the child on the side the ray comes from first
+		template <typename Nodes, typename LeafFunc>
+		static void traverseLinear(const Nodes& nodes, const Ray& r, float tMax, LeafFunc&& leafFunc);
+
+		//Same contract as traverseWide, over the widest layout of layouts that was built or its binary linearNodes_
+		//otherwise. layouts is anything with the layout members of BVH, i.e. a BVH or a MappedBvh.
+		template <typename Layouts, typename LeafFunc>
+		static void traverseWidest(const Layouts& layouts, const Ray& r, float tMax, LeafFunc&& leafFunc);
+
+		//traverseWidest over this BVH. The layouts should be current, call updateLayouts() first after insert() or remove().
+		template <typename LeafFunc>
+		void traverse(const Ray& r, float tMax, LeafFunc&& leafFunc) const;
+
 	private:
 
+		static const uint32_t NO_PARENT = 0xffffffff;
+		static const size_t MAX_TREELET_LEAVES = 8;
+
+		void restructureTreelets();
+
+		//Node with the lowest SAH cost increase when paired with a new leaf of bounds
+		BvhNode* findBestSibling(const AABB& bounds) const;
+
+		//Replaces a child by a grandchild from the other side when that shrinks the other child's area
+		void rotate(BvhNode* node);
+
+		//Recomputes the bounds from node up to the root, rotating every node on the way
+		void refitAncestors(BvhNode* node);
+
+		void removeLeaf(BvhNode* leaf);
+
+		//Recycles nodes dropped by remove() before growing the arena
+		BvhNode* allocateNode();
+
+		void restructureTreelet(BvhNode* root);
+
+		float computeSubtreeCost(BvhNode* node);
+
+		uint32_t flattenBvhTree(BvhNode* node, uint32_t* offset, uint32_t parent);
+
+		//Collapses and quantizes the build tree into the layouts selected by settings_
+		void buildWideLayouts();
+
+		//Rewrites the bounds of the wide or quantized layout from the refitted build tree, the collapse is kept
+		void refitWideLayouts();
+
+		template <int N>
+		void refitWideNodes(std::vector<WideBvhNode<N>>& nodes) const;
+
+		template <int N>
+		void refitQuantizedNodes(std::vector<QuantizedBvhNode<N>>& nodes) const;
+
+		//Pulls up grandchildren with the largest surface area until every node has Node::WIDTH children.
+		//sources, if given, receives the build tree node behind every child slot, Node::WIDTH per node.
+		template <typename Node>
+		typename Node::Index collapseBvhTree(BvhNode* node, std::vector<Node>& nodes, std::vector<BvhNode*>* sources = nullptr);
+
+		template <int N>
+		void quantizeWideNodes(const std::vector<WideBvhNode<N>>& wideNodes, std::vector<QuantizedBvhNode<N>>& nodes);
+
+		template <int N>
+		static void quantizeWideNode(const WideBvhNode<N>& wide, QuantizedBvhNode<N>& q);
+
+		//Transposes prims_ into the SoA packs selected by settings_
+		void buildTrianglePacks();
+
+		//Tests the leaf range [offset, offset + nPrims) pack by pack and shrinks tMax to the nearest hit.
+		//With hit == nullptr returns at the first hit without recording it.
+		template <typename Pack>
+		bool intersectPacks(const std::vector<Pack>& packs, const Ray& r, uint32_t offset, uint32_t nPrims, float& tMax, Hit* hit) const;
+
+		//intersectPacks over the packs that were built, or one triangle at a time without them.
+		//watertight is set exactly when settings_.watertight_ is, nullptr selects Moller-Trumbore.
+		bool intersectLeaf(const Ray& r, const WatertightRay* watertight, uint32_t offset, uint32_t nPrims, float& tMax, Hit* hit) const;
+
+		//Morton codes of the primitive centroids, sorted, on a cube around the centroid bounds
+		std::vector<MortonPrimitive> computeMortonPrimitives(const std::vector<PrimitiveInfo>& primInfo, int* totalBits) const;
+
+		//Bottom up agglomerative build, merges mutual nearest neighbours in Morton order until one cluster is left
+		BvhNode* plocBuild(std::vector<PrimitiveInfo>& primInfo, std::atomic<int>* totalNodes, std::vector<Triangle>& orderedPrims);
+
+		//Axis along which two child boxes are furthest apart
+		static int separatingAxis(const AABB& a, const AABB& b);
+
+		BvhNode* hlbvhBuild(std::vector<PrimitiveInfo>& primInfo, std::atomic<int>* totalNodes, std::vector<Triangle>& orderedPrims);
+
+		//Splits a run of Morton sorted primitives on successive code bits, leaves are written at orderedPrimsOffset
+		BvhNode* emitLbvh(const std::vector<PrimitiveInfo>& primInfo, const MortonPrimitive* mortonPrims, int nPrims, int* totalNodes,
+			std::vector<Triangle>& orderedPrims, std::atomic<int>* orderedPrimsOffset, int bitIndex);
+
+		//Binned SAH over the treelet roots emitted by emitLbvh
+		BvhNode* buildUpperSah(std::vector<PrimitiveInfo>& rootInfo, int start, int end, const std::vector<BvhNode*>& treeletRoots, std::atomic<int>* totalNodes);
+
+		//Median split on axis in O(n), returns the index of the first primitive of the right half
+		int partitionEqualCounts(std::vector<PrimitiveInfo>& primInfo, int start, int end, int axis) const;
+
+		//Binned SAH over all three axes, returns false when a leaf is cheaper than any split
+		bool partitionSah(std::vector<PrimitiveInfo>& primInfo, int start, int end, const AABB& bounds, const AABB& centroidBounds, int& axis, int& mid, float* splitCost = nullptr) const;
+
+		//Object or spatial split per node, whichever SAH prefers, straddling references are clipped into both children
+		BvhNode* recursiveBuildSbvh(std::vector<PrimitiveInfo>& refs, float rootArea, std::atomic<int>* totalNodes, std::vector<Triangle>& orderedPrims, int64_t* refsLeft);
+
+		//Binned spatial split over the node bounds, only reports planes cheaper than cost
+		bool findSpatialSplit(const std::vector<PrimitiveInfo>& refs, const AABB& bounds, float& cost, int& axis, float& position) const;
+
+		//Halves references of large triangles on their longest axis until they pass earlySplitThreshold_,
+		//every piece keeps the primNum_ of its triangle
+		void earlySplit(std::vector<PrimitiveInfo>& primInfo) const;
+
+		//Bounds of the part of triangle between lo and hi on axis, limited to refBounds
+		static AABB clipTriangle(const Triangle& triangle, const AABB& refBounds, int axis, float lo, float hi);
+
+		template <typename Policy>
+		friend class StaticBvh;
+
+		BvhNodeArena nodes_;
+		std::vector<BvhNode*> freeNodes_;
+		size_t totalNodes_;
 		std::vector<Triangle> prims_;
+		std::vector<uint32_t> primIndices_;
+		std::vector<TrianglePack<4>> trianglePacks4_;
+		std::vector<TrianglePack<8>> trianglePacks8_;
+		std::vector<uint32_t> parents_;
+		//Build tree node of every linearNodes_ entry, refit() copies the new bounds back through it
+		std::vector<BvhNode*> flattenedNodes_;
+		//Build tree node behind every child slot of the wide or quantized layout
+		std::vector<BvhNode*> wideSources_;
+		//Leaves holding each primitive index, only built on the first remove()
+		std::unordered_multimap<uint32_t, BvhNode*> primLeaves_;
+		bool leavesIndexed_ = false;
+		uint32_t nextPrimId_;
+		bool layoutStale_ = false;
 		BvhStrategy strategy_;
+		BvhBuildSettings settings_;
 		
 	};
-}
 
+	template<typename Nodes, typename LeafFunc>
+	inline void BVH::traverseWide(const Nodes& nodes, const Ray & r, float tMax, LeafFunc && leafFunc)
+	{
+		typedef typename std::decay<decltype(nodes[0])>::type Node;
+		const int N = Node::WIDTH;
+		if (nodes.empty())
+			return;
+
+		const glm::vec3 invDir = RayPrecomp(r, 0.0f, tMax).invDir_;
+		TraversalStack<typename Node::Index, 64 * N> stack;
+		stack.push(0);
+
+		while (!stack.empty())
+		{
+			const Node& node = nodes[stack.pop()];
+			float tEntry[N];
+			int mask = node.intersect(r.origin_, invDir, tMax, tEntry);
+
+			int order[N];
+			int nHits = 0;
+			if constexpr (N == 2)
+			{
+				//Binary nodes only need one compare to order their children, a leaf root fills only slot 0
+				const int nearest = tEntry[1] < tEntry[0] ? 1 : 0;
+				for (int i : { nearest, 1 - nearest })
+				{
+					if (i < node.nChildren_ && (mask & (1 << i)))
+						order[nHits++] = i;
+				}
+			}
+			else
+			{
+				for (int i = 0; i < node.nChildren_; i++)
+				{
+					if (!(mask & (1 << i)))
+						continue;
+
+					int j = nHits++;
+					for (; j > 0 && tEntry[order[j - 1]] > tEntry[i]; j--)
+						order[j] = order[j - 1];
+					order[j] = i;
+				}
+			}
+
+			//Leaves right away nearest first, interior children pushed far to near so the nearest pops next
+			for (int k = 0; k < nHits; k++)
+			{
+				int i = order[k];
+				if (node.isLeaf(i) && tEntry[i] <= tMax && leafFunc(node.child_[i], node.nPrims_[i], tMax))
+					return;
+			}
+
+			for (int k = nHits - 1; k >= 0; k--)
+			{
+				int i = order[k];
+				if (!node.isLeaf(i) && tEntry[i] <= tMax)
+					stack.push(node.child_[i]);
+			}
+		}
+	}
+
+	template<typename Nodes, typename LeafFunc>
+	inline void BVH::traverseLinear(const Nodes& nodes, const Ray & r, float tMax, LeafFunc && leafFunc)
+	{
+		if (nodes.empty())
+			return;
+
+		RayPrecomp precomp(r, 0.0f, tMax);
+		TraversalStack<uint32_t, 64> stack;
+		uint32_t current = 0;
+
+		while (true)
+		{
+			const LinearBvhNode& node = nodes[current];
+			float tEntry;
+			const bool hit = intersect(precomp, node.aabb_, tEntry);
+
+			if (hit && node.nPrims_ == 0)
+			{
+				//The child on the side the ray comes from first, the other one waits on the stack
+				if (precomp.dirIsNeg_[node.axis_]) {
+					stack.push(current + 1);
+					current = node.secondChildOffset_;
+				}
+				else {
+					stack.push(node.secondChildOffset_);
+					current = current + 1;
+				}
+				continue;
+			}
+
+			if (hit && leafFunc(node.primitivesOffset_, node.nPrims_, precomp.tMax_))
+				return;
+			if (stack.empty())
+				return;
+			current = stack.pop();
+		}
+	}
+
+	template<typename Layouts, typename LeafFunc>
+	inline void BVH::traverseWidest(const Layouts& layouts, const Ray & r, float tMax, LeafFunc && leafFunc)
+	{
+		if (!layouts.wideNodes8_.empty())
+			return traverseWide(layouts.wideNodes8_, r, tMax, leafFunc);
+		if (!layouts.wideNodes4_.empty())
+			return traverseWide(layouts.wideNodes4_, r, tMax, leafFunc);
+		if (!layouts.quantizedNodes8_.empty())
+			return traverseWide(layouts.quantizedNodes8_, r, tMax, leafFunc);
+		if (!layouts.quantizedNodes4_.empty())
+			return traverseWide(layouts.quantizedNodes4_, r, tMax, leafFunc);
+		traverseLinear(layouts.linearNodes_, r, tMax, leafFunc);
+	}
+
+	template<typename LeafFunc>
+	inline void BVH::traverse(const Ray & r, float tMax, LeafFunc && leafFunc) const
+	{
+		traverseWidest(*this, r, tMax, std::forward<LeafFunc>(leafFunc));
+	}
+
+	template<typename Node>
+	inline typename Node::Index BVH::collapseBvhTree(BvhNode * node, std::vector<Node>& nodes, std::vector<BvhNode*>* sources)
+	{
+		const int N = Node::WIDTH;
+		typedef typename Node::Index Index;
+		BvhNode* children[N];
+		int nChildren = 0;
+		if (node->nPrims_ > 0) {
+			children[nChildren++] = node;
+		}
+		else {
+			children[nChildren++] = node->children_[0];
+			children[nChildren++] = node->children_[1];
+		}
+
+		while (nChildren < N) {
+			int best = -1;
+			float bestArea = -1.0f;
+			for (int i = 0; i < nChildren; i++) {
+				if (children[i]->nPrims_ == 0 && children[i]->aabb_.surfaceArea() > bestArea) {
+					best = i;
+					bestArea = children[i]->aabb_.surfaceArea();
+				}
+			}
+
+			if (best < 0)
+				break;
+
+			BvhNode* opened = children[best];
+			children[best] = opened->children_[0];
+			children[nChildren++] = opened->children_[1];
+		}
+
+		//nodes grows while the children are collapsed, so only hold on to the index
+		const Index index = static_cast<Index>(nodes.size());
+		nodes.emplace_back();
+		if (sources != nullptr) {
+			sources->resize(nodes.size() * N, nullptr);
+			for (int i = 0; i < nChildren; i++) {
+				(*sources)[index * N + i] = children[i];
+			}
+		}
+
+		{
+			Node& wide = nodes[index];
+			wide.nChildren_ = static_cast<uint8_t>(nChildren);
+			for (int i = 0; i < N; i++) {
+				const bool used = i < nChildren;
+				const AABB& b = used ? children[i]->aabb_ : AABB();
+				wide.minX_[i] = b.min_.x; wide.minY_[i] = b.min_.y; wide.minZ_[i] = b.min_.z;
+				wide.maxX_[i] = b.max_.x; wide.maxY_[i] = b.max_.y; wide.maxZ_[i] = b.max_.z;
+				wide.child_[i] = used && children[i]->nPrims_ > 0 ? static_cast<Index>(children[i]->firstPrimOffset_) : 0;
+				wide.nPrims_[i] = used ? static_cast<uint16_t>(children[i]->nPrims_) : 0;
+			}
+		}
+
+		for (int i = 0; i < nChildren; i++) {
+			if (children[i]->nPrims_ == 0) {
+				Index childIndex = collapseBvhTree(children[i], nodes, sources);
+				nodes[index].child_[i] = childIndex;
+			}
+		}
+
+		return index;
+	}
+}
@@ -0,0 +1,133 @@
+#include "BuildCache.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+namespace
+{
+	//MurmurHash64A, eight bytes per step
+	uint64_t hashBytes(const char* data, size_t size, uint64_t seed)
+	{
+		const uint64_t m = 0xc6a4a7935bd1e995ull;
+		const int r = 47;
+		uint64_t h = seed ^ (size * m);
+
+		const size_t nWords = size / 8;
+		for (size_t i = 0; i < nWords; i++) {
+			uint64_t k;
+			std::memcpy(&k, data + i * 8, 8);
+			k *= m;
+			k ^= k >> r;
+			k *= m;
+			h ^= k;
+			h *= m;
+		}
+
+		const unsigned char* tail = reinterpret_cast<const unsigned char*>(data + nWords * 8);
+		switch (size & 7) {
+		case 7: h ^= uint64_t(tail[6]) << 48;
+			[[fallthrough]];
+		case 6: h ^= uint64_t(tail[5]) << 40;
+			[[fallthrough]];
+		case 5: h ^= uint64_t(tail[4]) << 32;
+			[[fallthrough]];
+		case 4: h ^= uint64_t(tail[3]) << 24;
+			[[fallthrough]];
+		case 3: h ^= uint64_t(tail[2]) << 16;
+			[[fallthrough]];
+		case 2: h ^= uint64_t(tail[1]) << 8;
+			[[fallthrough]];
+		case 1: h ^= uint64_t(tail[0]);
+			h *= m;
+		}
+
+		h ^= h >> r;
+		h *= m;
+		h ^= h >> r;
+		return h;
+	}
+
+	template <typename T>
+	void appendBytes(std::vector<char>& bytes, const T& value)
+	{
+		const char* p = reinterpret_cast<const char*>(&value);
+		bytes.insert(bytes.end(), p, p + sizeof(T));
+	}
+}
+
+bool MeshQuery::BvhBuildCache::computeKey(const std::string & assetPath, const glm::mat4 & objToWorld, BvhStrategy strategy, const BvhBuildSettings & settings, uint64_t & key) const
+{
+	std::ifstream file(assetPath, std::ios::binary);
+	if (!file)
+		return false;
+
+	std::vector<char> asset((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (file.bad())
+		return false;
+
+	//Field by field, hashing the structs whole would pick up their padding bytes
+	std::vector<char> inputs;
+	appendBytes(inputs, static_cast<uint32_t>(BvhFileHeader::VERSION));
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) {
+			appendBytes(inputs, objToWorld[i][j]);
+		}
+	}
+	appendBytes(inputs, static_cast<int32_t>(strategy));
+	appendBytes(inputs, static_cast<uint64_t>(settings.sahBuckets_));
+	appendBytes(inputs, settings.traversalCost_);
+	appendBytes(inputs, settings.intersectionCost_);
+	appendBytes(inputs, static_cast<uint64_t>(settings.maxPrimsInNode_));
+	appendBytes(inputs, static_cast<uint64_t>(settings.leafPrims_));
+	appendBytes(inputs, static_cast<uint64_t>(settings.mortonBits_));
+	//Below this cutoff ranges are split with the unstable std::partition, above it with the stable chunked one,
+	//so it changes the primitive order. Chunk and thread counts do not, bin merges are exact.
+	appendBytes(inputs, static_cast<uint64_t>(settings.parallelPassCutoff_));
+	appendBytes(inputs, static_cast<uint64_t>(settings.width_));
+	appendBytes(inputs, static_cast<uint64_t>(settings.plocRadius_));
+	appendBytes(inputs, settings.sbvhDuplicationBudget_);
+	appendBytes(inputs, settings.sbvhMinOverlap_);
+	appendBytes(inputs, static_cast<uint64_t>(settings.treeletPasses_));
+	appendBytes(inputs, static_cast<uint64_t>(settings.treeletLeaves_));
+	appendBytes(inputs, static_cast<uint8_t>(settings.quantize_));
+	appendBytes(inputs, settings.earlySplitThreshold_);
+	appendBytes(inputs, static_cast<uint64_t>(settings.earlySplitMaxRefs_));
+	//parallelBuildCutoff_ only decides which subtrees run as tasks, trianglePackWidth_ and watertight_ are left
+	//out too, files hold neither the packs nor the triangle test
+
+	key = hashBytes(inputs.data(), inputs.size(), hashBytes(asset.data(), asset.size(), 0));
+	return true;
+}
+
+bool MeshQuery::BvhBuildCache::load(uint64_t key, MappedBvh & bvh) const
+{
+	return bvh.open(path(key));
+}
+
+bool MeshQuery::BvhBuildCache::store(uint64_t key, const BVH & bvh) const
+{
+	std::error_code error;
+	std::filesystem::create_directories(directory_, error);
+	if (error)
+		return false;
+
+	const std::string target = path(key);
+	const std::string temporary = target + ".tmp";
+	if (!saveBvh(bvh, temporary)) {
+		std::filesystem::remove(temporary, error);
+		return false;
+	}
+
+	std::filesystem::rename(temporary, target, error);
+	return !error;
+}
+
+std::string MeshQuery::BvhBuildCache::path(uint64_t key) const
+{
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(key));
+	return (std::filesystem::path(directory_) / name).string();
+}
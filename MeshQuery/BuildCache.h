@@ -0,0 +1,31 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include "BvhFile.h"
+
+namespace MeshQuery
+{
+
+	//Directory of BVH files written by saveBvh, named after a hash of everything the build depends on.
+	//A changed asset, transform, strategy or setting gives a new key, so stale files are never read.
+	class BvhBuildCache
+	{
+	public:
+		explicit BvhBuildCache(const std::string& directory) : directory_(directory) {}
+
+		//Hashes the bytes of the asset file together with the build inputs, returns false if the asset can not be read
+		bool computeKey(const std::string& assetPath, const glm::mat4& objToWorld, BvhStrategy strategy, const BvhBuildSettings& settings, uint64_t& key) const;
+
+		//Maps the BVH stored under key, false on a miss
+		bool load(uint64_t key, MappedBvh& bvh) const;
+
+		//Writes to a temporary file first and renames it, so concurrent readers never map a partial file
+		bool store(uint64_t key, const BVH& bvh) const;
+
+	private:
+		std::string path(uint64_t key) const;
+
+		std::string directory_;
+	};
+}
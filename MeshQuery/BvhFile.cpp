@@ -0,0 +1,211 @@
+#include "BvhFile.h"
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	template <typename T>
+	void addSection(MeshQuery::BvhFileHeader& header, MeshQuery::BvhFileSection::Id id, const std::vector<T>& array, uint64_t* offset)
+	{
+		const uint64_t alignment = MeshQuery::BvhFileHeader::SECTION_ALIGNMENT;
+		*offset = (*offset + alignment - 1) / alignment * alignment;
+
+		MeshQuery::BvhFileSection& section = header.sections_[id];
+		section.offset_ = *offset;
+		section.count_ = array.size();
+		section.elementSize_ = sizeof(T);
+		section.pad_ = 0;
+		*offset += array.size() * sizeof(T);
+	}
+
+	template <typename T>
+	bool writeSection(std::ofstream& file, const MeshQuery::BvhFileSection& section, const std::vector<T>& array)
+	{
+		static const char zeros[MeshQuery::BvhFileHeader::SECTION_ALIGNMENT] = {};
+		const uint64_t padding = section.offset_ - static_cast<uint64_t>(file.tellp());
+		file.write(zeros, padding);
+		file.write(reinterpret_cast<const char*>(array.data()), array.size() * sizeof(T));
+		return file.good();
+	}
+}
+
+bool MeshQuery::saveBvh(const BVH & bvh, const std::string & path)
+{
+	if (bvh.isLayoutStale())
+		return false;
+
+	BvhFileHeader header;
+	std::memset(&header, 0, sizeof(header));
+	header.magic_ = BvhFileHeader::MAGIC;
+	header.version_ = BvhFileHeader::VERSION;
+
+	uint64_t offset = sizeof(BvhFileHeader);
+	addSection(header, BvhFileSection::LinearNodes, bvh.linearNodes_, &offset);
+	addSection(header, BvhFileSection::WideNodes4, bvh.wideNodes4_, &offset);
+	addSection(header, BvhFileSection::WideNodes8, bvh.wideNodes8_, &offset);
+	addSection(header, BvhFileSection::QuantizedNodes4, bvh.quantizedNodes4_, &offset);
+	addSection(header, BvhFileSection::QuantizedNodes8, bvh.quantizedNodes8_, &offset);
+	addSection(header, BvhFileSection::Primitives, bvh.getPrimitives(), &offset);
+	addSection(header, BvhFileSection::PrimitiveIndices, bvh.getPrimitiveIndices(), &offset);
+	header.fileSize_ = offset;
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file)
+		return false;
+
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	return writeSection(file, header.sections_[BvhFileSection::LinearNodes], bvh.linearNodes_) &&
+		writeSection(file, header.sections_[BvhFileSection::WideNodes4], bvh.wideNodes4_) &&
+		writeSection(file, header.sections_[BvhFileSection::WideNodes8], bvh.wideNodes8_) &&
+		writeSection(file, header.sections_[BvhFileSection::QuantizedNodes4], bvh.quantizedNodes4_) &&
+		writeSection(file, header.sections_[BvhFileSection::QuantizedNodes8], bvh.quantizedNodes8_) &&
+		writeSection(file, header.sections_[BvhFileSection::Primitives], bvh.getPrimitives()) &&
+		writeSection(file, header.sections_[BvhFileSection::PrimitiveIndices], bvh.getPrimitiveIndices());
+}
+
+bool MeshQuery::MappedBvh::intersect(const Ray & r, Hit & hit) const
+{
+	bool found = false;
+	traverse(r, std::numeric_limits<float>::max(), [&](uint32_t offset, uint32_t nPrims, float& tMax) {
+		for (uint32_t i = offset; i < offset + nPrims; i++) {
+			float t, u, v;
+			if (!intersect(r, primitives_[i], t, u, v) || !(t > 0.0f && t < tMax))
+				continue;
+
+			tMax = t;
+			hit.primId_ = primitiveIndices_[i];
+			hit.t_ = t;
+			hit.u_ = u;
+			hit.v_ = v;
+			found = true;
+		}
+		return false;
+	});
+
+	return found;
+}
+
+bool MeshQuery::MappedBvh::occluded(const Ray & r, float tMax) const
+{
+	bool found = false;
+	traverse(r, tMax, [&](uint32_t offset, uint32_t nPrims, float& maxT) {
+		for (uint32_t i = offset; i < offset + nPrims && !found; i++) {
+			float t, u, v;
+			found = intersect(r, primitives_[i], t, u, v) && t > 0.0f && t < maxT;
+		}
+		return found;
+	});
+
+	return found;
+}
+
+template <typename T>
+bool MeshQuery::MappedBvh::mapSection(const BvhFileHeader & header, BvhFileSection::Id id, MappedArray<T>& array) const
+{
+	const BvhFileSection& section = header.sections_[id];
+	if (section.elementSize_ != sizeof(T) || section.offset_ % BvhFileHeader::SECTION_ALIGNMENT != 0 ||
+		section.offset_ > size_ || section.count_ > (size_ - section.offset_) / sizeof(T))
+		return false;
+
+	array.data_ = reinterpret_cast<const T*>(data_ + section.offset_);
+	array.size_ = static_cast<size_t>(section.count_);
+	return true;
+}
+
+bool MeshQuery::MappedBvh::open(const std::string & path)
+{
+	close();
+
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = nullptr;
+	const void* view = nullptr;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart >= static_cast<LONGLONG>(sizeof(BvhFileHeader)))
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping != nullptr)
+		view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+	if (view == nullptr) {
+		if (mapping != nullptr)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	fileHandle_ = file;
+	mappingHandle_ = mapping;
+	data_ = static_cast<const char*>(view);
+	size_ = static_cast<size_t>(fileSize.QuadPart);
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat fileStat;
+	void* view = MAP_FAILED;
+	if (fstat(fd, &fileStat) == 0 && fileStat.st_size >= static_cast<off_t>(sizeof(BvhFileHeader)))
+		view = mmap(nullptr, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (view == MAP_FAILED)
+		return false;
+
+	data_ = static_cast<const char*>(view);
+	size_ = static_cast<size_t>(fileStat.st_size);
+#endif
+
+	BvhFileHeader header;
+	std::memcpy(&header, data_, sizeof(header));
+	const bool valid = header.magic_ == BvhFileHeader::MAGIC && header.version_ == BvhFileHeader::VERSION && header.fileSize_ == size_ &&
+		mapSection(header, BvhFileSection::LinearNodes, linearNodes_) &&
+		mapSection(header, BvhFileSection::WideNodes4, wideNodes4_) &&
+		mapSection(header, BvhFileSection::WideNodes8, wideNodes8_) &&
+		mapSection(header, BvhFileSection::QuantizedNodes4, quantizedNodes4_) &&
+		mapSection(header, BvhFileSection::QuantizedNodes8, quantizedNodes8_) &&
+		mapSection(header, BvhFileSection::Primitives, primitives_) &&
+		mapSection(header, BvhFileSection::PrimitiveIndices, primitiveIndices_);
+
+	if (!valid)
+		close();
+	return valid;
+}
+
+void MeshQuery::MappedBvh::close()
+{
+	if (data_ != nullptr) {
+#if defined(_WIN32)
+		UnmapViewOfFile(data_);
+		CloseHandle(static_cast<HANDLE>(mappingHandle_));
+		CloseHandle(static_cast<HANDLE>(fileHandle_));
+#else
+		munmap(const_cast<char*>(data_), size_);
+#endif
+	}
+
+	data_ = nullptr;
+	size_ = 0;
+	fileHandle_ = mappingHandle_ = nullptr;
+	linearNodes_ = {};
+	wideNodes4_ = {};
+	wideNodes8_ = {};
+	quantizedNodes4_ = {};
+	quantizedNodes8_ = {};
+	primitives_ = {};
+	primitiveIndices_ = {};
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include "AcclerationStructures.h"
+
+namespace MeshQuery
+{
+
+	//Array stored in a file section, in the same binary layout as in memory
+	struct BvhFileSection
+	{
+		enum Id
+		{
+			LinearNodes,
+			WideNodes4,
+			WideNodes8,
+			QuantizedNodes4,
+			QuantizedNodes8,
+			Primitives,
+			PrimitiveIndices,
+			COUNT
+		};
+
+		uint64_t offset_;		//from the start of the file, a multiple of BvhFileHeader::SECTION_ALIGNMENT
+		uint64_t count_;
+		uint32_t elementSize_;	//loading fails if this no longer matches the struct, e.g. after a layout change
+		uint32_t pad_;
+	};
+
+	struct BvhFileHeader
+	{
+		static const uint32_t MAGIC = 0x4856424d;		//"MBVH", reads differently on a machine of the other endianness
+		static const uint32_t VERSION = 1;
+		static const uint64_t SECTION_ALIGNMENT = 64;
+
+		uint32_t magic_;
+		uint32_t version_;
+		uint64_t fileSize_;
+		BvhFileSection sections_[BvhFileSection::COUNT];
+	};
+
+	//Writes the traversal layouts and the reordered primitives of bvh, fails if the layouts are stale or on I/O errors
+	bool saveBvh(const BVH& bvh, const std::string& path);
+
+	//Read only view of an array inside the mapping
+	template <typename T>
+	struct MappedArray
+	{
+		const T* data_ = nullptr;
+		size_t size_ = 0;
+
+		const T& operator[](size_t i) const { return data_[i]; }
+		const T* begin() const { return data_; }
+		const T* end() const { return data_ + size_; }
+		size_t size() const { return size_; }
+		bool empty() const { return size_ == 0; }
+	};
+
+	//BVH written by saveBvh, memory mapped read only. Opening validates the header and points the arrays
+	//into the mapping, nothing is copied or rebuilt. Queried like a built BVH, through the same traversal loops.
+	class MappedBvh : public AccelerationStructure
+	{
+	public:
+		using AccelerationStructure::intersect;
+
+		MappedBvh() = default;
+		MappedBvh(const MappedBvh&) = delete;
+		MappedBvh& operator=(const MappedBvh&) = delete;
+		~MappedBvh() { close(); }
+
+		//Returns false and stays closed if the file is missing, truncated or from another format version
+		bool open(const std::string& path);
+
+		void close();
+
+		bool isOpen() const { return data_ != nullptr; }
+
+		//Same contract as BVH::traverse, over the widest layout stored in the file
+		template <typename LeafFunc>
+		void traverse(const Ray& r, float tMax, LeafFunc&& leafFunc) const
+		{
+			BVH::traverseWidest(*this, r, tMax, std::forward<LeafFunc>(leafFunc));
+		}
+
+		//Closest and any hit like BVH::intersect and BVH::occluded. The file keeps no triangle packs or build
+		//settings, so leaves are tested one triangle at a time with Moller-Trumbore.
+		bool intersect(const Ray& r, Hit& hit) const;
+		bool occluded(const Ray& r, float tMax) const;
+
+		MappedArray<LinearBvhNode> linearNodes_;
+		MappedArray<WideBvhNode<4>> wideNodes4_;
+		MappedArray<WideBvhNode<8>> wideNodes8_;
+		MappedArray<QuantizedBvhNode<4>> quantizedNodes4_;
+		MappedArray<QuantizedBvhNode<8>> quantizedNodes8_;
+		MappedArray<Triangle> primitives_;
+		MappedArray<uint32_t> primitiveIndices_;
+
+	private:
+		template <typename T>
+		bool mapSection(const BvhFileHeader& header, BvhFileSection::Id id, MappedArray<T>& array) const;
+
+		const char* data_ = nullptr;
+		size_t size_ = 0;
+		void* fileHandle_ = nullptr;		//Windows only, POSIX closes the descriptor once mapped
+		void* mappingHandle_ = nullptr;
+	};
+}
@@ -0,0 +1,377 @@
+#pragma once
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+
+#include "AcclerationStructures.h"
+
+namespace MeshQuery
+{
+
+	//Compile time BVH configuration, StaticBvh bakes these into its builder, node layout and traversal loop
+	template <int Arity, size_t MaxLeafPrims, typename IndexType, BvhStrategy Strategy>
+	struct BvhPolicy
+	{
+		static_assert(Arity == 2 || Arity == 4 || Arity == 8, "Arity should be 2, 4 or 8");
+		static_assert(MaxLeafPrims >= 1 && MaxLeafPrims <= LinearBvhNode::MAX_PRIMS, "Leaves should hold 1 to 0xffff primitives");
+		static_assert(std::is_same<IndexType, uint32_t>::value || std::is_same<IndexType, uint64_t>::value, "Index should be uint32_t or uint64_t");
+		//Hlbvh, Ploc and Sbvh are built by BVH and collapsed from its uint32_t offsets, so with those strategies
+		//uint64_t only widens the node layout and node and primitive counts stay bounded by 2^32
+		static const int ARITY = Arity;
+		static const size_t MAX_LEAF_PRIMS = MaxLeafPrims;
+		static const BvhStrategy STRATEGY = Strategy;
+		typedef IndexType Index;
+
+		//Strategies StaticBvh builds top down straight into its own node layout
+		static const bool DIRECT_BUILD = Strategy == Sah || Strategy == Middle || Strategy == EqualCountes;
+	};
+
+	//Same SoA layout as WideBvhNode, with the width and index type fixed by the policy
+	template <typename Policy>
+	struct alignas(32) StaticBvhNode
+	{
+		static const int WIDTH = Policy::ARITY;
+		typedef typename Policy::Index Index;
+
+		//slabTestSoa for 4 and 8 children, a fixed trip count scalar loop for binary nodes
+		int intersect(const glm::vec3& org, const glm::vec3& invDir, float tMax, float* tEntry) const;
+
+		bool isLeaf(int i) const { return nPrims_[i] > 0; }
+
+		float minX_[WIDTH], minY_[WIDTH], minZ_[WIDTH];
+		float maxX_[WIDTH], maxY_[WIDTH], maxZ_[WIDTH];
+		Index child_[WIDTH];				//primitive offset for leaves, node index otherwise
+		uint16_t nPrims_[WIDTH];			//0 for interior children
+		uint8_t nChildren_;
+	};
+
+	//BVH whose arity, leaf size, index width and split strategy are template parameters instead of
+	//BvhBuildSettings fields. Sah, Middle and EqualCountes are built top down straight into StaticBvhNode, with
+	//the strategy and leaf size resolved at compile time. The other strategies need the runtime builder, their
+	//BVH is built by BVH and collapsed into the same layout. Every policy gets its own traversal code.
+	template <typename Policy>
+	class StaticBvh
+	{
+	public:
+		typedef StaticBvhNode<Policy> Node;
+		typedef typename Policy::Index Index;
+
+		//settings only supply the SAH costs and buckets, plus the builder tuning of the runtime built strategies.
+		//The policy overrides the fields it fixes.
+		explicit StaticBvh(const std::vector<Triangle>& prims, BvhBuildSettings settings = BvhBuildSettings());
+
+		const std::vector<Node>& getNodes() const { return nodes_; }
+
+		//Primitives in leaf order, leaf offsets index into this
+		const std::vector<Triangle>& getPrimitives() const { return prims_; }
+
+		//Index into the triangles the BVH was built from for every entry of getPrimitives()
+		const std::vector<Index>& getPrimitiveIndices() const { return primIndices_; }
+
+		//Same contract as BVH::traverseWide
+		template <typename LeafFunc>
+		void traverse(const Ray& r, float tMax, LeafFunc&& leafFunc) const
+		{
+			BVH::traverseWide(nodes_, r, tMax, std::forward<LeafFunc>(leafFunc));
+		}
+
+	private:
+		struct BuildRange
+		{
+			size_t start_, end_;
+			AABB bounds_;
+			AABB centroidBounds_;
+		};
+
+		//A range together with its split, decided once when the range is created
+		struct BuildCandidate
+		{
+			BuildRange range_;
+			bool leaf_;
+			BuildRange left_, right_;
+		};
+
+		BuildRange makeRange(const std::vector<PrimitiveInfo>& primInfo, size_t start, size_t end) const;
+
+		BuildCandidate makeCandidate(std::vector<PrimitiveInfo>& primInfo, const BuildRange& range) const;
+
+		//Partitions range in two with the policy's strategy, false if it should stay a leaf
+		bool splitRange(std::vector<PrimitiveInfo>& primInfo, const BuildRange& range, BuildRange& left, BuildRange& right) const;
+
+		//Binned SAH over all three axes, false if no plane separates the centroids or a leaf is cheaper
+		bool splitSah(std::vector<PrimitiveInfo>& primInfo, const BuildRange& range, size_t& mid) const;
+
+		//Fills a node with up to ARITY children by opening the largest interior candidate, like
+		//BVH::collapseBvhTree does on a built tree, and recurses into the interior children
+		Index buildNode(std::vector<PrimitiveInfo>& primInfo, const BuildCandidate& candidate);
+
+		std::vector<Node> nodes_;
+		std::vector<Triangle> prims_;
+		std::vector<Index> primIndices_;
+		BvhBuildSettings settings_;
+	};
+
+	template<typename Policy>
+	inline int StaticBvhNode<Policy>::intersect(const glm::vec3 & org, const glm::vec3 & invDir, float tMax, float * tEntry) const
+	{
+		if constexpr (WIDTH == 4 || WIDTH == 8) {
+			return slabTestSoa<WIDTH>(minX_, minY_, minZ_, maxX_, maxY_, maxZ_, org, invDir, tMax, tEntry) & ((1 << nChildren_) - 1);
+		}
+		else {
+			int mask = 0;
+			for (int i = 0; i < WIDTH; i++) {
+				float tx0 = (minX_[i] - org.x) * invDir.x, tx1 = (maxX_[i] - org.x) * invDir.x;
+				float ty0 = (minY_[i] - org.y) * invDir.y, ty1 = (maxY_[i] - org.y) * invDir.y;
+				float tz0 = (minZ_[i] - org.z) * invDir.z, tz1 = (maxZ_[i] - org.z) * invDir.z;
+
+				float tNear = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.0f));
+				float tFar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)) * RayPrecomp::EXIT_SCALE, std::min(std::max(tz0, tz1) * RayPrecomp::EXIT_SCALE, tMax));
+
+				tEntry[i] = tNear;
+				mask |= (tNear <= tFar) << i;
+			}
+
+			//Empty slots past nChildren_ hold inverted bounds that would otherwise pass the test
+			return mask & ((1 << nChildren_) - 1);
+		}
+	}
+
+	template<typename Policy>
+	inline StaticBvh<Policy>::StaticBvh(const std::vector<Triangle>& prims, BvhBuildSettings settings)
+	{
+		settings.maxPrimsInNode_ = Policy::MAX_LEAF_PRIMS;
+		settings.leafPrims_ = Policy::MAX_LEAF_PRIMS;
+		settings_ = settings;
+		if (prims.size() > std::numeric_limits<Index>::max())
+			throw std::length_error("BVH is too big for the index type of its policy");
+
+		if constexpr (Policy::DIRECT_BUILD) {
+			std::vector<PrimitiveInfo> primInfo(prims.size());
+			for (size_t i = 0; i < prims.size(); i++) {
+				primInfo[i] = { i, prims[i].aabb_ };
+			}
+
+			//At most one node per primitive, the node count is bounded by the primitive count
+			nodes_.reserve(prims.size());
+			if (!primInfo.empty())
+				buildNode(primInfo, makeCandidate(primInfo, makeRange(primInfo, 0, primInfo.size())));
+
+			prims_.resize(primInfo.size());
+			primIndices_.resize(primInfo.size());
+			for (size_t i = 0; i < primInfo.size(); i++) {
+				prims_[i] = prims[primInfo[i].primNum_];
+				primIndices_[i] = static_cast<Index>(primInfo[i].primNum_);
+			}
+		}
+		else {
+			//The runtime layouts are not needed, nodes_ is collapsed from the build tree directly
+			settings.width_ = 2;
+			settings.quantize_ = false;
+			settings.trianglePackWidth_ = 0;
+
+			BVH bvh(prims, Policy::STRATEGY, settings);
+			if (bvh.linearNodes_.size() > std::numeric_limits<Index>::max() || bvh.getPrimitives().size() > std::numeric_limits<Index>::max())
+				throw std::length_error("BVH is too big for the index type of its policy");
+
+			if (bvh.root_ != nullptr)
+				bvh.collapseBvhTree(bvh.root_, nodes_);
+
+			prims_ = bvh.getPrimitives();
+			primIndices_.assign(bvh.getPrimitiveIndices().begin(), bvh.getPrimitiveIndices().end());
+		}
+	}
+
+	template<typename Policy>
+	inline typename StaticBvh<Policy>::BuildRange StaticBvh<Policy>::makeRange(const std::vector<PrimitiveInfo>& primInfo, size_t start, size_t end) const
+	{
+		BuildRange range;
+		range.start_ = start;
+		range.end_ = end;
+		for (size_t i = start; i < end; i++) {
+			range.bounds_ = Union(range.bounds_, primInfo[i].aabb_);
+			range.centroidBounds_ = Union(range.centroidBounds_, primInfo[i].centroid_);
+		}
+		return range;
+	}
+
+	template<typename Policy>
+	inline typename StaticBvh<Policy>::BuildCandidate StaticBvh<Policy>::makeCandidate(std::vector<PrimitiveInfo>& primInfo, const BuildRange & range) const
+	{
+		BuildCandidate candidate;
+		candidate.range_ = range;
+		candidate.leaf_ = !splitRange(primInfo, range, candidate.left_, candidate.right_);
+		return candidate;
+	}
+
+	template<typename Policy>
+	inline bool StaticBvh<Policy>::splitRange(std::vector<PrimitiveInfo>& primInfo, const BuildRange & range, BuildRange & left, BuildRange & right) const
+	{
+		const size_t numOfPrims = range.end_ - range.start_;
+		if (numOfPrims == 1 || (Policy::STRATEGY != Sah && numOfPrims <= Policy::MAX_LEAF_PRIMS))
+			return false;
+
+		PrimitiveInfo* first = primInfo.data() + range.start_;
+		PrimitiveInfo* last = primInfo.data() + range.end_;
+		const int axis = range.centroidBounds_.getDominantAxis();
+		size_t mid = range.start_;
+
+		if (range.centroidBounds_.max_[axis] > range.centroidBounds_.min_[axis]) {
+			if constexpr (Policy::STRATEGY == Sah) {
+				if (!splitSah(primInfo, range, mid) && numOfPrims <= Policy::MAX_LEAF_PRIMS)
+					return false;
+			}
+			else if constexpr (Policy::STRATEGY == Middle) {
+				const float midPt = (range.centroidBounds_.min_[axis] + range.centroidBounds_.max_[axis]) / 2;
+				mid = std::partition(first, last, [axis, midPt](const PrimitiveInfo& prim) {
+					return prim.centroid_[axis] < midPt;
+				}) - primInfo.data();
+			}
+		}
+		else if (numOfPrims <= Policy::MAX_LEAF_PRIMS) {
+			return false;
+		}
+
+		//EqualCountes, and the fallback whenever the strategy leaves one side empty, e.g. on coincident centroids
+		if (mid == range.start_ || mid == range.end_) {
+			mid = range.start_ + numOfPrims / 2;
+			std::nth_element(first, primInfo.data() + mid, last, [axis](const PrimitiveInfo& a, const PrimitiveInfo& b) {
+				return a.centroid_[axis] < b.centroid_[axis];
+			});
+		}
+
+		left = makeRange(primInfo, range.start_, mid);
+		right = makeRange(primInfo, mid, range.end_);
+		return true;
+	}
+
+	template<typename Policy>
+	inline bool StaticBvh<Policy>::splitSah(std::vector<PrimitiveInfo>& primInfo, const BuildRange & range, size_t & mid) const
+	{
+		struct Bucket
+		{
+			size_t count_ = 0;
+			AABB aabb_;
+		};
+
+		const size_t nBuckets = std::max<size_t>(2, std::min<size_t>(settings_.sahBuckets_, size_t(BvhBuildSettings::MAX_SAH_BUCKETS)));
+		const AABB& centroidBounds = range.centroidBounds_;
+		auto bucketOf = [&](const PrimitiveInfo& prim, int dim) {
+			return std::min(nBuckets - 1, static_cast<size_t>(static_cast<float>(nBuckets) * centroidBounds.offset(prim.centroid_)[dim]));
+		};
+
+		Bucket buckets[3][BvhBuildSettings::MAX_SAH_BUCKETS];
+		for (size_t i = range.start_; i < range.end_; i++) {
+			for (int dim = 0; dim < 3; dim++) {
+				Bucket& bucket = buckets[dim][bucketOf(primInfo[i], dim)];
+				bucket.count_++;
+				bucket.aabb_ = Union(bucket.aabb_, primInfo[i].aabb_);
+			}
+		}
+
+		const size_t numOfPrims = range.end_ - range.start_;
+		const float invArea = 1.0f / std::max(range.bounds_.surfaceArea(), std::numeric_limits<float>::min());
+		float bestCost = std::numeric_limits<float>::max();
+		int bestAxis = -1;
+		size_t bestSplit = 0;
+
+		for (int dim = 0; dim < 3; dim++) {
+			if (centroidBounds.max_[dim] <= centroidBounds.min_[dim])
+				continue;
+
+			//Sweep from the right so the left sweep can evaluate every split plane in one pass
+			float rightArea[BvhBuildSettings::MAX_SAH_BUCKETS];
+			size_t rightCount[BvhBuildSettings::MAX_SAH_BUCKETS];
+			AABB acc;
+			size_t count = 0;
+			for (size_t i = nBuckets - 1; i > 0; i--) {
+				acc = Union(acc, buckets[dim][i].aabb_);
+				count += buckets[dim][i].count_;
+				rightArea[i] = acc.surfaceArea();
+				rightCount[i] = count;
+			}
+
+			acc = AABB();
+			count = 0;
+			for (size_t i = 1; i < nBuckets; i++) {
+				acc = Union(acc, buckets[dim][i - 1].aabb_);
+				count += buckets[dim][i - 1].count_;
+				if (count == 0 || rightCount[i] == 0)
+					continue;
+
+				float cost = settings_.traversalCost_ + settings_.intersectionCost_ *
+					(static_cast<float>(count) * acc.surfaceArea() + static_cast<float>(rightCount[i]) * rightArea[i]) * invArea;
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = dim;
+					bestSplit = i;
+				}
+			}
+		}
+
+		float leafCost = settings_.intersectionCost_ * static_cast<float>(numOfPrims);
+		if (bestAxis < 0 || (numOfPrims <= Policy::MAX_LEAF_PRIMS && leafCost <= bestCost))
+			return false;
+
+		mid = std::partition(primInfo.data() + range.start_, primInfo.data() + range.end_, [&](const PrimitiveInfo& prim) {
+			return bucketOf(prim, bestAxis) < bestSplit;
+		}) - primInfo.data();
+		return true;
+	}
+
+	template<typename Policy>
+	inline typename StaticBvh<Policy>::Index StaticBvh<Policy>::buildNode(std::vector<PrimitiveInfo>& primInfo, const BuildCandidate & candidate)
+	{
+		const int N = Node::WIDTH;
+		BuildCandidate children[N];
+		int nChildren = 0;
+		if (candidate.leaf_) {
+			children[nChildren++] = candidate;
+		}
+		else {
+			children[nChildren++] = makeCandidate(primInfo, candidate.left_);
+			children[nChildren++] = makeCandidate(primInfo, candidate.right_);
+		}
+
+		while (nChildren < N) {
+			int best = -1;
+			float bestArea = -1.0f;
+			for (int i = 0; i < nChildren; i++) {
+				if (!children[i].leaf_ && children[i].range_.bounds_.surfaceArea() > bestArea) {
+					best = i;
+					bestArea = children[i].range_.bounds_.surfaceArea();
+				}
+			}
+			if (best < 0)
+				break;
+
+			const BuildCandidate opened = children[best];
+			children[best] = makeCandidate(primInfo, opened.left_);
+			children[nChildren++] = makeCandidate(primInfo, opened.right_);
+		}
+
+		const Index index = static_cast<Index>(nodes_.size());
+		nodes_.emplace_back();
+		{
+			Node& node = nodes_[index];
+			node.nChildren_ = static_cast<uint8_t>(nChildren);
+			for (int i = 0; i < N; i++) {
+				const bool used = i < nChildren;
+				const AABB& b = used ? children[i].range_.bounds_ : AABB();
+				node.minX_[i] = b.min_.x; node.minY_[i] = b.min_.y; node.minZ_[i] = b.min_.z;
+				node.maxX_[i] = b.max_.x; node.maxY_[i] = b.max_.y; node.maxZ_[i] = b.max_.z;
+				node.child_[i] = used && children[i].leaf_ ? static_cast<Index>(children[i].range_.start_) : 0;
+				node.nPrims_[i] = used && children[i].leaf_ ? static_cast<uint16_t>(children[i].range_.end_ - children[i].range_.start_) : 0;
+			}
+		}
+
+		for (int i = 0; i < nChildren; i++) {
+			if (!children[i].leaf_) {
+				const Index childIndex = buildNode(primInfo, children[i]);
+				nodes_[index].child_[i] = childIndex;
+			}
+		}
+
+		return index;
+	}
+}
@@ -0,0 +1,137 @@
+#include "TaskPool.h"
+
+namespace
+{
+	thread_local const MeshQuery::TaskPool* currentPool = nullptr;
+	thread_local size_t currentQueue = 0;
+}
+
+MeshQuery::TaskPool::TaskPool(size_t nThreads)
+{
+	nThreads = std::max<size_t>(1, nThreads);
+
+	for (size_t i = 0; i < nThreads; i++)
+	{
+		queues_.push_back(std::make_unique<Queue>());
+	}
+
+	for (size_t i = 0; i + 1 < nThreads; i++)
+	{
+		threads_.emplace_back(&TaskPool::workerLoop, this, i);
+	}
+}
+
+MeshQuery::TaskPool::~TaskPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex_);
+		done_ = true;
+	}
+	wake_.notify_all();
+
+	for (auto& t : threads_)
+	{
+		t.join();
+	}
+}
+
+MeshQuery::TaskPool & MeshQuery::TaskPool::instance()
+{
+	static TaskPool pool(std::max(1u, std::thread::hardware_concurrency()));
+	return pool;
+}
+
+void MeshQuery::TaskPool::run(TaskGroup & group, Task task)
+{
+	group.pending_++;
+
+	Queue& q = *queues_[queueIndex()];
+	{
+		std::lock_guard<std::mutex> lock(q.mutex_);
+		q.entries_.push_back({ std::move(task), &group });
+	}
+	queued_++;
+
+	//Taking the lock orders the push before a worker's predicate check, so the wakeup can not be lost
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex_);
+	}
+	wake_.notify_one();
+}
+
+void MeshQuery::TaskPool::wait(TaskGroup & group)
+{
+	const size_t self = queueIndex();
+	Entry entry;
+
+	while (group.pending_ > 0)
+	{
+		if (popTask(self, entry))
+			execute(entry);
+		else
+			std::this_thread::yield();
+	}
+}
+
+size_t MeshQuery::TaskPool::queueIndex() const
+{
+	return currentPool == this ? currentQueue : queues_.size() - 1;
+}
+
+bool MeshQuery::TaskPool::popTask(size_t self, Entry & entry)
+{
+	{
+		Queue& q = *queues_[self];
+		std::lock_guard<std::mutex> lock(q.mutex_);
+		if (!q.entries_.empty())
+		{
+			entry = std::move(q.entries_.back());
+			q.entries_.pop_back();
+			queued_--;
+			return true;
+		}
+	}
+
+	for (size_t i = 1; i < queues_.size(); i++)
+	{
+		Queue& q = *queues_[(self + i) % queues_.size()];
+		std::lock_guard<std::mutex> lock(q.mutex_);
+		if (!q.entries_.empty())
+		{
+			entry = std::move(q.entries_.front());
+			q.entries_.pop_front();
+			queued_--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void MeshQuery::TaskPool::execute(Entry & entry)
+{
+	entry.task_();
+	entry.task_ = nullptr;
+	entry.group_->pending_--;
+}
+
+void MeshQuery::TaskPool::workerLoop(size_t index)
+{
+	currentPool = this;
+	currentQueue = index;
+	Entry entry;
+
+	while (true)
+	{
+		if (popTask(index, entry))
+		{
+			execute(entry);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleepMutex_);
+		wake_.wait(lock, [this]() { return done_ || queued_ > 0; });
+		if (done_)
+			return;
+	}
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace MeshQuery
+{
+	//Fork/join pool where every worker owns a deque, pops its own newest task and steals the oldest from others.
+	//Threads waiting on a group keep running tasks, so tasks can fork and wait on nested groups.
+	class TaskPool
+	{
+	public:
+		using Task = std::function<void()>;
+
+		class TaskGroup
+		{
+		public:
+			TaskGroup() = default;
+			TaskGroup(const TaskGroup&) = delete;
+			TaskGroup& operator=(const TaskGroup&) = delete;
+
+		private:
+			friend class TaskPool;
+			std::atomic<int> pending_{ 0 };
+		};
+
+		TaskPool() = delete;
+		explicit TaskPool(size_t nThreads);
+		TaskPool(const TaskPool&) = delete;
+		TaskPool& operator=(const TaskPool&) = delete;
+		~TaskPool();
+
+		//Process wide pool with one worker per hardware thread
+		static TaskPool& instance();
+
+		//Number of threads that execute tasks, the waiting caller included
+		size_t threadCount() const { return threads_.size() + 1; }
+
+		void run(TaskGroup& group, Task task);
+
+		void wait(TaskGroup& group);
+
+		//Runs func(i) for i in [0, count), indices are handed out dynamically
+		template <typename Func>
+		void parallelFor(size_t count, const Func& func)
+		{
+			if (count == 0)
+				return;
+
+			std::atomic<size_t> next(0);
+			auto body = [&]() {
+				for (size_t i = next++; i < count; i = next++)
+					func(i);
+			};
+
+			TaskGroup group;
+			const size_t nTasks = std::min(count, threadCount());
+			for (size_t t = 1; t < nTasks; t++)
+				run(group, body);
+			body();
+			wait(group);
+		}
+
+	private:
+		struct Entry
+		{
+			Task task_;
+			TaskGroup* group_;
+		};
+
+		struct Queue
+		{
+			std::mutex mutex_;
+			std::deque<Entry> entries_;
+		};
+
+		//Index of the queue owned by the calling thread, threads outside the pool share the last one
+		size_t queueIndex() const;
+
+		bool popTask(size_t self, Entry& entry);
+
+		void execute(Entry& entry);
+
+		void workerLoop(size_t index);
+
+		std::vector<std::unique_ptr<Queue>> queues_;
+		std::vector<std::thread> threads_;
+		std::atomic<int> queued_{ 0 };
+		std::atomic<bool> done_{ false };
+		std::mutex sleepMutex_;
+		std::condition_variable wake_;
+	};
+}
@@ -0,0 +1,69 @@
+#include "TwoLevelBvh.h"
+
+namespace
+{
+	MeshQuery::AABB transformBounds(const MeshQuery::AABB& aabb, const glm::mat4& m)
+	{
+		MeshQuery::AABB result;
+		for (int i = 0; i < 8; i++) {
+			glm::vec3 corner((i & 1) ? aabb.max_.x : aabb.min_.x, (i & 2) ? aabb.max_.y : aabb.min_.y, (i & 4) ? aabb.max_.z : aabb.min_.z);
+			result.extendBy(glm::vec3(m * glm::vec4(corner, 1.0f)));
+		}
+		return result;
+	}
+}
+
+uint32_t MeshQuery::TwoLevelBvh::addMesh(const std::vector<Triangle>& prims, BvhStrategy strategy, const BvhBuildSettings & settings)
+{
+	meshes_.push_back(std::make_unique<BVH>(prims, strategy, settings));
+	return static_cast<uint32_t>(meshes_.size() - 1);
+}
+
+uint32_t MeshQuery::TwoLevelBvh::addInstance(uint32_t mesh, const glm::mat4 & objToWorld)
+{
+	BvhInstance instance;
+	instance.mesh_ = mesh;
+	instances_.push_back(instance);
+	setTransform(static_cast<uint32_t>(instances_.size() - 1), objToWorld);
+	return static_cast<uint32_t>(instances_.size() - 1);
+}
+
+void MeshQuery::TwoLevelBvh::setTransform(uint32_t instance, const glm::mat4 & objToWorld)
+{
+	BvhInstance& inst = instances_[instance];
+	inst.objToWorld_ = objToWorld;
+	inst.worldToObj_ = glm::inverse(objToWorld);
+
+	const BVH& mesh = *meshes_[inst.mesh_];
+	inst.aabb_ = mesh.root_ != nullptr ? transformBounds(mesh.root_->aabb_, objToWorld) : AABB();
+}
+
+void MeshQuery::TwoLevelBvh::build()
+{
+	//Instances are few and their boxes overlap, so the top level is built with full SAH and a 4 wide layout
+	BvhBuildSettings settings;
+	settings.width_ = 4;
+	settings.maxPrimsInNode_ = 2;
+	//Leaves hold instance boxes, not triangles to pack
+	settings.trianglePackWidth_ = 0;
+	topLevel_ = std::make_unique<BVH>(instanceBounds(), Sah, settings);
+}
+
+void MeshQuery::TwoLevelBvh::refit()
+{
+	if (topLevel_)
+		topLevel_->refit(instanceBounds());
+}
+
+std::vector<MeshQuery::Triangle> MeshQuery::TwoLevelBvh::instanceBounds() const
+{
+	//The builders only look at aabb_, so each instance becomes a triangle spanning its world box
+	std::vector<Triangle> bounds(instances_.size());
+	for (size_t i = 0; i < instances_.size(); i++) {
+		bounds[i].vertices_[0] = instances_[i].aabb_.min_;
+		bounds[i].vertices_[1] = instances_[i].aabb_.max_;
+		bounds[i].vertices_[2] = instances_[i].aabb_.max_;
+		bounds[i].aabb_ = instances_[i].aabb_;
+	}
+	return bounds;
+}
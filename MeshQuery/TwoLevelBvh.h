@@ -0,0 +1,88 @@
+#pragma once
+#include <memory>
+#include <vector>
+
+#include "AcclerationStructures.h"
+
+namespace MeshQuery
+{
+
+	//One placement of a mesh, the mesh triangles stay in object space and are shared by all its instances
+	struct BvhInstance
+	{
+		uint32_t mesh_;
+		glm::mat4 objToWorld_;
+		glm::mat4 worldToObj_;
+		AABB aabb_;			//world space bounds of the transformed mesh
+	};
+
+	//Top level BVH over instances, each pointing at a bottom level BVH that is built once per mesh.
+	//Rays reach the meshes in object space, transformed at the top level leaves.
+	class TwoLevelBvh
+	{
+	public:
+		TwoLevelBvh() = default;
+		TwoLevelBvh(const TwoLevelBvh&) = delete;
+		TwoLevelBvh& operator=(const TwoLevelBvh&) = delete;
+
+		//Builds the bottom level BVH of prims, given in object space, and returns the index of the mesh
+		uint32_t addMesh(const std::vector<Triangle>& prims, BvhStrategy strategy, const BvhBuildSettings& settings = BvhBuildSettings());
+
+		//Returns the index of the instance, the top level is only updated by build() or refit()
+		uint32_t addInstance(uint32_t mesh, const glm::mat4& objToWorld);
+
+		void setTransform(uint32_t instance, const glm::mat4& objToWorld);
+
+		//Rebuilds the top level over all instances
+		void build();
+
+		//Recomputes the top level bounds after setTransform() and keeps its topology, like BVH::refit.
+		//Instances added since the last build() need another build().
+		void refit();
+
+		const BVH& getMesh(uint32_t mesh) const { return *meshes_[mesh]; }
+		const std::vector<BvhInstance>& getInstances() const { return instances_; }
+
+		//Visits the mesh leaves hit by r. The ray is not normalized when transformed, so distances along
+		//the object space ray are the same as along r and tMax carries over between instances.
+		//leafFunc(instance, objectRay, primOffset, nPrims, tMax) gets a range of getMesh(mesh_).getPrimitives(),
+		//may shrink tMax and returns true to stop the traversal.
+		template <typename LeafFunc>
+		void traverse(const Ray& r, float tMax, LeafFunc&& leafFunc) const;
+
+	private:
+		std::vector<Triangle> instanceBounds() const;
+
+		std::vector<std::unique_ptr<BVH>> meshes_;
+		std::vector<BvhInstance> instances_;
+		std::unique_ptr<BVH> topLevel_;
+	};
+
+	template<typename LeafFunc>
+	inline void TwoLevelBvh::traverse(const Ray & r, float tMax, LeafFunc && leafFunc) const
+	{
+		if (!topLevel_)
+			return;
+
+		const std::vector<uint32_t>& instanceIds = topLevel_->getPrimitiveIndices();
+		topLevel_->traverse(r, tMax, [&](uint32_t offset, uint32_t nInstances, float& tMaxTop) {
+			for (uint32_t i = offset; i < offset + nInstances; i++) {
+				const uint32_t id = instanceIds[i];
+				const BvhInstance& instance = instances_[id];
+				const Ray objectRay(glm::vec3(instance.worldToObj_ * glm::vec4(r.origin_, 1.0f)),
+					glm::vec3(instance.worldToObj_ * glm::vec4(r.direction_, 0.0f)));
+
+				bool stop = false;
+				meshes_[instance.mesh_]->traverse(objectRay, tMaxTop, [&](uint32_t primOffset, uint32_t nPrims, float& tMaxMesh) {
+					stop = leafFunc(id, objectRay, primOffset, nPrims, tMaxMesh);
+					tMaxTop = tMaxMesh;
+					return stop;
+				});
+
+				if (stop)
+					return true;
+			}
+			return false;
+		});
+	}
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <cmath>
 #include <glm/glm.hpp>
 
 namespace MeshQuery
@@ -24,6 +25,32 @@ namespace MeshQuery
 		glm::vec3 direction_;
 	};
 
+	//Terms of the slab test that only depend on the ray, computed once per ray instead of per box,
+	//together with the interval of the ray that is still of interest
+	struct RayPrecomp
+	{
+		//Slab exits are scaled by 1 + 2 * gamma(3) to cover the rounding of the slab distances, so boxes that
+		//only touch the ray, e.g. at an edge shared by two triangles, are never culled
+		static constexpr float EXIT_SCALE = 1.0000004f;
+
+		RayPrecomp(const Ray& r, float tMin, float tMax) : origin_(r.origin_), tMin_(tMin), tMax_(tMax)
+		{
+			//Zero components become tiny ones with a huge but finite inverse, an infinite one gives 0 * inf = NaN
+			//for boxes touching the origin
+			const float minDirection = 1e-20f;
+			for (int i = 0; i < 3; i++) {
+				const float d = std::fabs(r.direction_[i]) < minDirection ? std::copysign(minDirection, r.direction_[i]) : r.direction_[i];
+				invDir_[i] = 1.0f / d;
+				dirIsNeg_[i] = invDir_[i] < 0.0f ? 1 : 0;
+			}
+		}
+
+		glm::vec3 origin_;
+		glm::vec3 invDir_;
+		int dirIsNeg_[3];
+		float tMin_, tMax_;
+	};
+
 	class AABB
 	{
 	public:
@@ -89,7 +116,7 @@ namespace MeshQuery
 			max_ = glm::vec3(roundUp(round, 2));
 		}
 
-		int getDominantAxis() {
+		int getDominantAxis() const {
 			glm::vec3 d = max_ - min_;
 
 			if (d.x > d.y && d.x > d.z)
@@ -100,6 +127,27 @@ namespace MeshQuery
 				return 2;
 		}
 
+		bool isEmpty() const {
+			return min_.x > max_.x || min_.y > max_.y || min_.z > max_.z;
+		}
+
+		float surfaceArea() const {
+			glm::vec3 d = max_ - min_;
+			if (d.x < 0.0f || d.y < 0.0f || d.z < 0.0f)
+				return 0.0f;
+
+			return 2.0f * (d.x * d.y + d.x * d.z + d.y * d.z);
+		}
+
+		//Position of p relative to the box, 0 at min_ and 1 at max_ on each axis
+		glm::vec3 offset(const glm::vec3& p) const {
+			glm::vec3 o = p - min_;
+			if (max_.x > min_.x) o.x /= max_.x - min_.x;
+			if (max_.y > min_.y) o.y /= max_.y - min_.y;
+			if (max_.z > min_.z) o.z /= max_.z - min_.z;
+			return o;
+		}
+
 		glm::vec3 min_;
 		glm::vec3 max_;
 	};
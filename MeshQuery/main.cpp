@@ -7,6 +7,7 @@
 #include "ApplicationDriver.h"
 #include "RenderAbstractAPI.h"
 #include "AcclerationStructures.h"
+#include "BuildCache.h"
 
 #define USE_BVH
 using namespace MeshQuery;
@@ -14,7 +15,8 @@ using namespace MeshQuery;
 using milisec = std::chrono::milliseconds;
 using seconds = std::chrono::seconds;
 std::unique_ptr<OctreeNode> octRoot;
-BvhNode* bvhRoot = nullptr;
+std::unique_ptr<BVH> bvh;
+MappedBvh cachedBvh;
 
 class Callbacks : public SDLCallbacks
 {
@@ -69,8 +71,17 @@ void Callbacks::onInit()
 		oc.insertTriangle(octRoot.get(), t);
 	}
 #elif defined(USE_BVH)
-	BVH builder(mesh.triangles_, Middle);
-	bvhRoot = builder.root_;
+	//Triangles are baked with objToWorld_, so the transform is part of the key next to the asset and settings
+	BvhBuildCache cache("../Cache");
+	BvhBuildSettings settings;
+	uint64_t key = 0;
+	bool cacheable = cache.computeKey(asset, mesh.objToWorld_, Middle, settings, key);
+	if (!cacheable || !cache.load(key, cachedBvh))
+	{
+		bvh = std::make_unique<BVH>(mesh.triangles_, Middle, settings);
+		if (cacheable)
+			cache.store(key, *bvh);
+	}
 #endif
 
 }
@@ -99,22 +110,18 @@ void Callbacks::onViewportSizeChanged(int w, int h)
     RenderAbstractAPI::projection = glm::perspective(45.0f, w / (float)h, 1.f, 1000.0f);
 }
 
-void print(BvhNode* node)
+void print(const LinearBvhNode* nodes, size_t count)
 {
-	if (node == nullptr)
+	if (count == 0 || nodes[0].nPrims_ > 0)
 		return;
 
 	float white[] = { 1.0f, 1.0f, 1.0f, 1.0f };
 
-	if (node->children_[0] != nullptr)
-	{
-		add_gl_db_aabb(&node->children_[0]->aabb_.min_[0], &node->children_[0]->aabb_.max_[0], white);
-	}
-
-	if (node->children_[1] != nullptr)
-	{
-		add_gl_db_aabb(&node->children_[1]->aabb_.min_[0], &node->children_[1]->aabb_.max_[0], white);
-	}
+	//First child follows its parent in the depth first layout
+	AABB first = nodes[1].aabb_;
+	AABB second = nodes[nodes[0].secondChildOffset_].aabb_;
+	add_gl_db_aabb(&first.min_[0], &first.max_[0], white);
+	add_gl_db_aabb(&second.min_[0], &second.max_[0], white);
 }
 
 void print(OctreeNode* node)
@@ -170,7 +177,10 @@ void Callbacks::onRenderFrame(double deltaTime)
 #ifndef USE_BVH
 	print(octRoot.get());
 #else
-	print(bvhRoot);
+	if (bvh)
+		print(bvh->linearNodes_.data(), bvh->linearNodes_.size());
+	else
+		print(cachedBvh.linearNodes_.data_, cachedBvh.linearNodes_.size());
 #endif
 	draw_gl_db(false);
 #endif